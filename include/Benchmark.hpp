@@ -0,0 +1,57 @@
+/**
+ * @file Benchmark.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains a benchmark of every stage of the processing.
+ *
+ * The benchmark generates synthetic images, always the same for the same
+ * size, and measures the throughput of pixelization with each pixel
+ * selector, normalization, and quantization with each color strategy and
+ * dithering algorithm. The results are reported as JSON, so they can be
+ * compared between versions.
+ *
+ */
+#ifndef __MIPA_BENCHMARK_HPP__
+#define __MIPA_BENCHMARK_HPP__
+
+#include <functional>
+#include <string>
+
+#include <SFML/Graphics.hpp>
+
+#include "json.hpp"
+#include "ThreadPool.hpp"
+
+namespace mipa{
+    /**
+     * @brief Generate a deterministic synthetic image.
+     *
+     * @param kind "noise" for uniform random noise, "gradient" for smooth
+     * gradients, or "photo" for smooth shapes with sharp edges and some grain
+     * @param width Width of the image
+     * @param height Height of the image
+     * @return sf::Image
+     * @throw std::runtime_error if the kind doesn't exist
+     */
+    sf::Image syntheticImage(const std::string& kind, uint width, uint height);
+
+    /**
+     * @brief Run the benchmark.
+     *
+     * The options object may contain:
+     * - "megapixels": Array of input sizes, in megapixels (default = [1, 12, 48]).
+     * - "inputs": Array of synthetic image kinds (default = all of them).
+     * - "repeat": Times each measure is repeated, keeping the best (default = 3).
+     * - "width", "height": Maximum size of the pixelized output (default = 64).
+     *
+     * @param options Benchmark options
+     * @param pool Threads to use
+     * @param progress Function called with the name of each measure before
+     * running it
+     * @return nlohmann::json Object with the host information and an array
+     * of results, each with the Mpixel/s and ns/pixel of a measure
+     */
+    nlohmann::json benchmark(const nlohmann::json& options, ThreadPool& pool, const std::function<void(const std::string&)>& progress);
+}
+
+#endif
@@ -11,6 +11,9 @@
  * conversions between different operations, but it shouldn't affect performance
  * significatively.
  * 
+ * Distances that follow the perceived difference are measured in OKLab or
+ * CIE L*a*b*, converting each channel to linear light with a table.
+ * 
  * It provides also three global parameters used in the grayscale calculations.
  * It is not realistic to weight each channel in the RGB space equally to
  * compute the gray value, as yellow is perceived brighter and blue, darker.
@@ -23,6 +26,8 @@
 #ifndef __MIPA_COLOR_HPP__
 #define __MIPA_COLOR_HPP__
 
+#include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <SFML/Graphics.hpp>
 
@@ -43,6 +48,40 @@ namespace mipa{
         int a=0x255; /// alpha [0, 255]
     } HSV;  
 
+    /**
+     * @brief Color in HSV space in fixed point, converted with integer
+     * operations only, so the results are the same with any compiler.
+     */
+    typedef struct {
+        uint16_t h=0; ///< Hue [0, 1535], 256 steps per sector of 60º
+        uint8_t s=0; ///< Saturation [0, 255]
+        uint8_t v=0; ///< Value [0, 255]
+        uint8_t a=255; ///< alpha [0, 255]
+    } FixedHSV;
+
+    /**
+     * @brief Number of steps of the hue of FixedHSV in a whole turn.
+     */
+    const uint16_t FIXED_HUES = 1536;
+
+    /**
+     * @brief Perceptually uniform color spaces, where the euclidean distance
+     * follows the perceived difference better than in the RGB space.
+     */
+    typedef enum {
+        OKLAB, ///< OKLab, with lightness in [0.0, 1.0]
+        CIELAB ///< CIE L*a*b* with the D65 white point, lightness in [0.0, 100.0]
+    } LabSpace;
+
+    /**
+     * @brief Color in a perceptually uniform space. @see LabSpace
+     */
+    typedef struct {
+        float l=0; ///< Lightness
+        float a=0; ///< Green to red
+        float b=0; ///< Blue to yellow
+    } Lab;
+
     /**
      * @brief Factor to multiply the red value of color to compute the grayscale.
      */
@@ -58,6 +97,84 @@ namespace mipa{
      */
     extern float BLUE_BRIGHTNESS;
 
+    /**
+     * @brief Lookup tables of the weighted squared value of each channel, to
+     * compute gray values without multiplying.
+     *
+     * Besides the gray value, each color has an integer key: its squared gray
+     * value in fixed point, which sorts colors by brightness without the
+     * square root.
+     */
+    class Luminance{
+    public:
+        /**
+         * @brief Return the tables for the current brightness factors. They
+         * are rebuilt only when the factors change, and the old ones are
+         * kept, so the returned tables stay valid.
+         *
+         * @return const Luminance&
+         * @see RED_BRIGHTNESS
+         * @see GREEN_BRIGHTNESS
+         * @see BLUE_BRIGHTNESS
+         */
+        static const Luminance& current();
+
+        /**
+         * @brief Normalized gray value of a color, the same as grayValue.
+         *
+         * @param color
+         * @return float
+         */
+        inline float value(const RGB& color) const{
+            return brightness(color) / 255.0;
+        }
+
+        /**
+         * @brief Gray value of a color in [0, 255].
+         *
+         * @param color
+         * @return float
+         */
+        inline float brightness(const RGB& color) const{
+            return std::sqrt(m_r[color.r] + m_g[color.g] + m_b[color.b]);
+        }
+
+        /**
+         * @brief Integer key of a color. Brighter colors have bigger keys.
+         *
+         * @param color
+         * @return uint32_t
+         */
+        inline uint32_t key(const RGB& color) const{
+            return m_keyR[color.r] + m_keyG[color.g] + m_keyB[color.b];
+        }
+
+        /**
+         * @brief Compute the normalized gray values of a row of colors.
+         *
+         * @param colors Input colors
+         * @param out Gray value of each color
+         * @param n Number of colors
+         */
+        void values(const RGB* colors, float* out, size_t n) const;
+
+        /**
+         * @brief Compute the integer keys of a row of colors.
+         *
+         * @param colors Input colors
+         * @param out Key of each color
+         * @param n Number of colors
+         */
+        void keys(const RGB* colors, uint32_t* out, size_t n) const;
+
+    private:
+        Luminance(float red, float green, float blue);
+
+        float m_red, m_green, m_blue;
+        float m_r[256], m_g[256], m_b[256];
+        uint32_t m_keyR[256], m_keyG[256], m_keyB[256];
+    };
+
     /**
      * @brief Convert color from HSV space to RGB. Keep the alpha value.
      * 
@@ -76,6 +193,82 @@ namespace mipa{
      */
     HSV toHSV(const RGB& rgb);
 
+    /**
+     * @brief Convert a row of colors from RGB space to HSV, with each
+     * component in its own array.
+     * 
+     * Every color goes through the same operations without branches, four
+     * at a time with SSE2 when available.
+     * 
+     * @param rgb Input colors.
+     * @param h Hue of each color, in [0.0, 360.0).
+     * @param s Saturation of each color, in [0.0, 1.0].
+     * @param v Value of each color, in [0.0, 1.0].
+     * @param n Number of colors.
+     * @see toHSV
+     */
+    void toHSV(const RGB* rgb, float* h, float* s, float* v, size_t n);
+
+    /**
+     * @brief Convert color from RGB space to fixed point HSV, with each
+     * component rounded to the nearest step. Keep the alpha value.
+     * 
+     * @param rgb Input color in RGB space.
+     * @return FixedHSV
+     */
+    FixedHSV toFixedHSV(const RGB& rgb);
+
+    /**
+     * @brief Convert color from fixed point HSV space to RGB, with each
+     * channel rounded to the nearest value. Keep the alpha value.
+     * 
+     * @param hsv Input color in fixed point HSV space.
+     * @return RGB
+     */
+    RGB toRGB(const FixedHSV& hsv);
+
+    /**
+     * @brief Convert a row of colors from RGB space to fixed point HSV, with
+     * each component in its own array. Same results as toFixedHSV, eight
+     * colors at a time with SSE2 when available.
+     * 
+     * @param rgb Input colors.
+     * @param h Hue of each color, in [0, 1535].
+     * @param s Saturation of each color, in [0, 255].
+     * @param v Value of each color, in [0, 255].
+     * @param n Number of colors.
+     * @see toFixedHSV
+     */
+    void toFixedHSV(const RGB* rgb, uint16_t* h, uint8_t* s, uint8_t* v, size_t n);
+
+    /**
+     * @brief Convert a row of colors from fixed point HSV space, with each
+     * component in its own array, to RGB. Same results as toRGB of each
+     * FixedHSV, keeping the alpha of the output colors.
+     * 
+     * @param h Hue of each color, in [0, 1535].
+     * @param s Saturation of each color, in [0, 255].
+     * @param v Value of each color, in [0, 255].
+     * @param rgb Output colors.
+     * @param n Number of colors.
+     * @see toRGB
+     */
+    void toRGB(const uint16_t* h, const uint8_t* s, const uint8_t* v, RGB* rgb, size_t n);
+
+    /**
+     * @brief Convert a row of colors from HSV space, with each component in
+     * its own array, to RGB. The alpha of the output colors is kept, so the
+     * row can be converted back in place.
+     * 
+     * @param h Hue of each color. Any angle is wrapped into [0.0, 360.0).
+     * @param s Saturation of each color, in [0.0, 1.0].
+     * @param v Value of each color, in [0.0, 1.0].
+     * @param rgb Output colors.
+     * @param n Number of colors.
+     * @see toRGB
+     */
+    void toRGB(const float* h, const float* s, const float* v, RGB* rgb, size_t n);
+
     /**
      * @brief Copy a color with an offset in the hue.
      * 
@@ -90,6 +283,17 @@ namespace mipa{
      */
     RGB shiftHue(const RGB& color, float angle);
 
+    /**
+     * @brief Offset the hue of a row of colors.
+     * 
+     * @param in Input colors.
+     * @param out Output colors, which may be the input.
+     * @param n Number of colors.
+     * @param angle Offset in the chromatic wheel.
+     * @see shiftHue
+     */
+    void shiftHue(const RGB* in, RGB* out, size_t n, float angle);
+
     /**
      * @brief Copy the color with a different saturation.
      * 
@@ -127,6 +331,7 @@ namespace mipa{
      * 
      * @param color 
      * @return float
+     * @see Luminance
      * @see RED_BRIGHTNESS 
      * @see BLUE_BRIGHTNESS 
      * @see GREEN_BRIGHTNESS 
@@ -142,6 +347,52 @@ namespace mipa{
      */
     float rgbDistance(const RGB& a, const RGB& b);
 
+    /**
+     * @brief Linear light of an sRGB channel, from a table computed once.
+     * 
+     * @param value Channel value [0, 255]
+     * @return float Linear light [0.0, 1.0]
+     */
+    float toLinear(uint8_t value);
+
+    /**
+     * @brief Convert color from RGB space to a perceptually uniform space.
+     * Ignore the alpha value.
+     * 
+     * @param rgb Input color in RGB space.
+     * @param space Output space.
+     * @return Lab
+     */
+    Lab toLab(const RGB& rgb, LabSpace space = OKLAB);
+
+    /**
+     * @brief Convert a row of colors from RGB space to a perceptually uniform
+     * space, with each component in its own array. Same results as toLab,
+     * four colors at a time with SSE2 when available.
+     * 
+     * @param rgb Input colors.
+     * @param l Lightness of each color.
+     * @param a Green to red component of each color.
+     * @param b Blue to yellow component of each color.
+     * @param n Number of colors.
+     * @param space Output space.
+     * @see toLab
+     */
+    void toLab(const RGB* rgb, float* l, float* a, float* b, size_t n, LabSpace space = OKLAB);
+
+    /**
+     * @brief Bounding box in a perceptually uniform space of every color
+     * whose channels are between those of two colors. Slightly bigger than
+     * the tightest one, so it contains the results of toLab.
+     * 
+     * @param lo Lowest value of each channel.
+     * @param hi Highest value of each channel.
+     * @param space Space of the box.
+     * @param min Lowest value of each component.
+     * @param max Highest value of each component.
+     */
+    void labBounds(const RGB& lo, const RGB& hi, LabSpace space, Lab& min, Lab& max);
+
     /**
      * @brief Squared euclidean distance in the RGB space between two colors.
      * 
@@ -160,6 +411,16 @@ namespace mipa{
      * @return float 
      */
     float grayDistance(const RGB& a, const RGB& b);
+
+    /**
+     * @brief Squared euclidean distance between two colors in a perceptually
+     * uniform space.
+     * 
+     * @param a 
+     * @param b 
+     * @return float 
+     */
+    float labSquaredDistance(const Lab& a, const Lab& b);
     RGB lerp(const RGB& from, const RGB& to, float t);
 
     /**
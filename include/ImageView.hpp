@@ -0,0 +1,131 @@
+/**
+ * @file ImageView.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains a lightweight view over the pixels of an image.
+ *
+ * Image processing functions work on rows of contiguous RGBA pixels instead
+ * of going through sf::Image::getPixel and sf::Image::setPixel for every
+ * pixel. A view doesn't own the memory it points to, so it can wrap the
+ * pixels of a sf::Image as well as any buffer owned by the caller, as long
+ * as each pixel is stored as four bytes in RGBA order.
+ *
+ */
+#ifndef __MIPA_IMAGEVIEW_HPP__
+#define __MIPA_IMAGEVIEW_HPP__
+
+#include <cstddef>
+
+#include <SFML/Graphics.hpp>
+
+#include "Color.hpp"
+
+namespace mipa{
+    static_assert(sizeof(RGB) == 4, "RGB must be stored as four bytes");
+
+    /**
+     * @brief Rectangle of pixels in memory, made of rows separated by a
+     * stride.
+     *
+     * @tparam T RGB for mutable views, const RGB for read only views
+     */
+    template <typename T>
+    struct BasicImageView{
+        T* pixels; ///< First pixel of the first row
+        uint width; ///< Pixels per row
+        uint height; ///< Number of rows
+        uint stride; ///< Pixels from the start of a row to the next one
+
+        inline BasicImageView(): pixels(nullptr), width(0), height(0), stride(0){}
+        inline BasicImageView(T* p, uint w, uint h):
+            pixels(p), width(w), height(h), stride(w)
+            {}
+        inline BasicImageView(T* p, uint w, uint h, uint s):
+            pixels(p), width(w), height(h), stride(s)
+            {}
+        /**
+         * @brief Allow passing mutable views as read only views.
+         */
+        template <typename U>
+        inline BasicImageView(const BasicImageView<U>& other):
+            pixels(other.pixels), width(other.width), height(other.height), stride(other.stride)
+            {}
+
+        /**
+         * @brief Pointer to the first pixel of a row.
+         *
+         * @param y Row
+         * @return T*
+         */
+        inline T* row(uint y) const{
+            return pixels + (std::size_t)y * stride;
+        }
+
+        /**
+         * @brief Pixel at the given coordinates. Not bounds checked.
+         *
+         * @param x Column
+         * @param y Row
+         * @return T&
+         */
+        inline T& operator()(uint x, uint y) const{
+            return row(y)[x];
+        }
+
+        /**
+         * @brief View of a rectangle inside this view.
+         *
+         * @param x First column
+         * @param y First row
+         * @param w Width of the rectangle
+         * @param h Height of the rectangle
+         * @return BasicImageView
+         */
+        inline BasicImageView sub(uint x, uint y, uint w, uint h) const{
+            return BasicImageView(row(y) + x, w, h, stride);
+        }
+
+        inline bool empty() const{
+            return width == 0 || height == 0;
+        }
+    };
+
+    /**
+     * @brief Mutable view of an image.
+     */
+    typedef BasicImageView<RGB> ImageView;
+
+    /**
+     * @brief Read only view of an image.
+     */
+    typedef BasicImageView<const RGB> ConstImageView;
+
+    /**
+     * @brief Read only view of the pixels of a sf::Image.
+     *
+     * @param image Image to view. The view is invalidated if the image is
+     * resized or destroyed.
+     * @return ConstImageView
+     */
+    inline ConstImageView view(const sf::Image& image){
+        sf::Vector2u size = image.getSize();
+        return ConstImageView(reinterpret_cast<const RGB*>(image.getPixelsPtr()), size.x, size.y);
+    }
+
+    /**
+     * @brief Mutable view of the pixels of a sf::Image.
+     *
+     * SFML only exposes a read only pointer to the pixels, but they are
+     * owned by the image, which is not const, so writing through it is safe.
+     *
+     * @param image Image to view. The view is invalidated if the image is
+     * resized or destroyed.
+     * @return ImageView
+     */
+    inline ImageView view(sf::Image& image){
+        sf::Vector2u size = image.getSize();
+        return ImageView(const_cast<RGB*>(reinterpret_cast<const RGB*>(image.getPixelsPtr())), size.x, size.y);
+    }
+}
+
+#endif
@@ -0,0 +1,117 @@
+/**
+ * @file IntegralImage.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains the summed-area table used to average blocks of
+ * an image in constant time.
+ *
+ * Each entry of the table holds the sum of every pixel above and to the left
+ * of it, so the sum of any rectangle takes four lookups regardless of its
+ * size. The table is built in a single pass and can be reused to reduce the
+ * same image to any number of sizes.
+ *
+ */
+#ifndef __MIPA_INTEGRALIMAGE_HPP__
+#define __MIPA_INTEGRALIMAGE_HPP__
+
+#include <cstdint>
+#include <vector>
+
+#include "Color.hpp"
+#include "ImageView.hpp"
+#include "ThreadPool.hpp"
+
+namespace mipa{
+    /**
+     * @brief Per channel summed-area table of an image, with 64 bit sums.
+     */
+    class IntegralImage{
+    public:
+        /**
+         * @brief Build an empty table. @see build
+         */
+        IntegralImage();
+
+        /**
+         * @brief Build the table of an image.
+         *
+         * @param image Source image
+         * @param pool Threads to use, or nullptr to build it in this one
+         */
+        explicit IntegralImage(ConstImageView image, ThreadPool* pool = nullptr);
+
+        /**
+         * @brief Rebuild the table for another image, reusing the memory
+         * when possible.
+         *
+         * With several threads, each one sums a band of rows as if it was
+         * the top of the image, and then the sums of the bands above are
+         * added to it.
+         *
+         * @param image Source image
+         * @param pool Threads to use, or nullptr to build it in this one
+         */
+        void build(ConstImageView image, ThreadPool* pool = nullptr);
+
+        /**
+         * @brief Return the average color of a rectangle, rounded down.
+         *
+         * The rectangle covers the columns [x0, x1) and the rows [y0, y1),
+         * and must be inside the image and not empty.
+         *
+         * @param x0 First column
+         * @param y0 First row
+         * @param x1 Column after the last one
+         * @param y1 Row after the last one
+         * @return RGB
+         */
+        inline RGB average(uint x0, uint y0, uint x1, uint y1) const{
+            const uint64_t* a = entry(x0, y0);
+            const uint64_t* b = entry(x1, y0);
+            const uint64_t* c = entry(x0, y1);
+            const uint64_t* d = entry(x1, y1);
+            uint64_t n = (uint64_t)(x1 - x0) * (y1 - y0);
+            return RGB(
+                (d[0] - b[0] - c[0] + a[0]) / n,
+                (d[1] - b[1] - c[1] + a[1]) / n,
+                (d[2] - b[2] - c[2] + a[2]) / n,
+                (d[3] - b[3] - c[3] + a[3]) / n
+            );
+        }
+
+        inline uint getWidth() const{
+            return m_width;
+        }
+
+        inline uint getHeight() const{
+            return m_height;
+        }
+
+        /**
+         * @brief Number of entries the table and its band offsets can hold
+         * without allocating. It only changes when one of them grows.
+         *
+         * @return size_t
+         */
+        inline size_t getCapacity() const{
+            return m_sums.capacity() + m_offsets.capacity();
+        }
+
+    private:
+        void sumRows(ConstImageView image, uint begin, uint end);
+
+        inline const uint64_t* entry(uint x, uint y) const{
+            return &m_sums[((size_t)y * (m_width + 1) + x) * 4];
+        }
+
+        uint m_width;
+        uint m_height;
+        // (width + 1) x (height + 1) entries of 4 channels, with a first row
+        // and column of zeros
+        std::vector<uint64_t> m_sums;
+        // Sums of the rows above each band, when built in parallel
+        std::vector<uint64_t> m_offsets;
+    };
+}
+
+#endif
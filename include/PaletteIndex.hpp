@@ -0,0 +1,119 @@
+/**
+ * @file PaletteIndex.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains a spatial index to search the closest colors of
+ * a palette.
+ *
+ * The index is a k-d tree over the colors of the palette. It answers nearest
+ * and k-nearest color queries in logarithmic time, without allocating memory
+ * and without copying the palette, so it scales to big palettes loaded from
+ * files.
+ *
+ */
+#ifndef __MIPA_PALETTEINDEX_HPP__
+#define __MIPA_PALETTEINDEX_HPP__
+
+#include <vector>
+
+#include "Color.hpp"
+#include "Palette.hpp"
+
+namespace mipa{
+    /**
+     * @brief Criteria to compare the similarity of two colors.
+     */
+    typedef enum {
+        RGB_DISTANCE, ///< Euclidean distance in the RGB space. @see rgbSquaredDistance
+        GRAY_DISTANCE ///< Difference between gray values. @see grayDistance
+    } ColorMetric;
+
+    /**
+     * @brief Spatial index of the colors of a palette.
+     *
+     * Equally close colors are returned in the order they have in the palette.
+     *
+     * @see closestByColor
+     * @see closestByBrightness
+     */
+    class PaletteIndex{
+    public:
+        /**
+         * @brief Build the index of a palette.
+         *
+         * @param palette Non empty palette
+         * @param metric Criteria to compare colors
+         */
+        PaletteIndex(const Palette& palette, ColorMetric metric = RGB_DISTANCE);
+
+        /**
+         * @brief Return the color of the palette closest to the given one.
+         *
+         * @param color Reference color
+         * @return const RGB&
+         */
+        const RGB& closest(const RGB& color) const;
+
+        /**
+         * @brief Find the @p k colors of the palette closest to the given one.
+         *
+         * @param color Reference color
+         * @param k Maximum number of colors to find
+         * @param indices Output buffer with room for @p k palette indices,
+         * filled from the closest to the furthest color
+         * @return uint Number of indices written, the minimum between @p k
+         * and the palette size
+         */
+        uint closest(const RGB& color, uint k, uint* indices) const;
+
+        /**
+         * @brief Same as closest, to use the index as a color strategy.
+         *
+         * @param color Reference color
+         * @return RGB
+         */
+        inline RGB operator()(const RGB& color) const{
+            return closest(color);
+        }
+
+        /**
+         * @brief Palette indexed.
+         *
+         * @return const Palette&
+         */
+        inline const Palette& getPalette() const{
+            return m_palette;
+        }
+
+        /**
+         * @brief Criteria used to compare colors.
+         *
+         * @return ColorMetric
+         */
+        inline ColorMetric getMetric() const{
+            return m_metric;
+        }
+
+    private:
+        struct Node{
+            float key[3];
+            uint index;
+            int axis;
+        };
+        struct Query;
+
+        void build(uint lo, uint hi);
+        void key(const RGB& color, float* out) const;
+        void search(uint lo, uint hi, Query& query) const;
+
+        Palette m_palette;
+        ColorMetric m_metric;
+        int m_dims;
+        // Gray values of the queries and the palette are computed alike
+        const Luminance* m_luminance;
+        // Implicit balanced tree: the node of a range is the one in the middle
+        std::vector<Node> m_nodes;
+    };
+}
+
+#endif
@@ -0,0 +1,128 @@
+/**
+ * @file PaletteScan.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains a vectorized linear search of the closest color
+ * of a palette.
+ *
+ * For small palettes, comparing the color against every entry is cheaper
+ * than any index, as long as it is done several entries at a time. The
+ * palette is stored as a structure of arrays, with a separate array per
+ * channel, and the distances are computed with SSE2 or AVX2 instructions,
+ * depending on what the host CPU supports. The choice is made at runtime,
+ * so the same binary works on older hosts.
+ *
+ */
+#ifndef __MIPA_PALETTESCAN_HPP__
+#define __MIPA_PALETTESCAN_HPP__
+
+#include <vector>
+
+#include "Color.hpp"
+#include "Palette.hpp"
+
+namespace mipa{
+    /**
+     * @brief Palette stored as a structure of arrays, searched by brute force.
+     *
+     * Uses the euclidean distance in the RGB space or in a perceptually
+     * uniform one. In the latter, the palette is converted once and each row
+     * of colors is converted in batches before the search. Equally close
+     * colors are resolved to the first one in the palette.
+     *
+     * @see closestByColor
+     */
+    class PaletteScan{
+    public:
+        /**
+         * @brief Build the structure of arrays of a palette.
+         *
+         * @param palette Non empty palette
+         */
+        PaletteScan(const Palette& palette);
+
+        /**
+         * @brief Build the structure of arrays of a palette, converted to a
+         * perceptually uniform space.
+         *
+         * @param palette Non empty palette
+         * @param space Space where the distances are measured
+         */
+        PaletteScan(const Palette& palette, LabSpace space);
+
+        /**
+         * @brief Return the index in the palette of the color closest to the
+         * given one.
+         *
+         * @param color Reference color
+         * @return uint
+         */
+        uint closestIndex(const RGB& color) const;
+
+        /**
+         * @brief Return the color of the palette closest to the given one.
+         *
+         * @param color Reference color
+         * @return const RGB&
+         */
+        inline const RGB& closest(const RGB& color) const{
+            return m_palette[closestIndex(color)];
+        }
+
+        /**
+         * @brief Same as closest, to use the scan as a color strategy.
+         *
+         * @param color Reference color
+         * @return RGB
+         */
+        inline RGB operator()(const RGB& color) const{
+            return closest(color);
+        }
+
+        /**
+         * @brief Replace each color of a row with the closest color of the
+         * palette.
+         *
+         * @param in Input colors
+         * @param out Output colors. May be the same as @p in
+         * @param n Number of colors in the row
+         */
+        void quantizeRow(const RGB* in, RGB* out, uint n) const;
+
+        /**
+         * @brief Palette searched.
+         *
+         * @return const Palette&
+         */
+        inline const Palette& getPalette() const{
+            return m_palette;
+        }
+
+        /**
+         * @brief Name of the instruction set used by the search in this
+         * host: "avx2", "sse2" or "scalar".
+         *
+         * @return const char*
+         */
+        static const char* instructionSet();
+
+        /**
+         * @brief Search function: returns the index of the entry closest to a
+         * point, given the channel arrays, their padded size and the point.
+         */
+        typedef uint (*Kernel)(const float*, const float*, const float*, uint, float, float, float);
+
+    private:
+        void build(const Palette& palette);
+
+        Palette m_palette;
+        Kernel m_kernel;
+        bool m_perceptual;
+        LabSpace m_space;
+        // Channels or lab components, padded to a multiple of 16 entries
+        // with unreachable values
+        std::vector<float> m_x, m_y, m_z;
+    };
+}
+
+#endif
@@ -0,0 +1,190 @@
+/**
+ * @file PaletteTable.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains lookup tables to find the closest color of a
+ * palette in constant time.
+ *
+ * Sorting the whole palette for every pixel, like closestByColor does, is too
+ * expensive when quantizing full images. The tables split the color space in
+ * cells and store, for each cell, the few palette colors that can be the
+ * closest one to any color inside it. A query only has to check those
+ * candidates, so the result is exact and doesn't depend on the palette size.
+ *
+ */
+#ifndef __MIPA_PALETTETABLE_HPP__
+#define __MIPA_PALETTETABLE_HPP__
+
+#include <vector>
+
+#include "Color.hpp"
+#include "Palette.hpp"
+
+namespace mipa{
+    /**
+     * @brief Precomputed nearest color lookup for a palette, using the
+     * euclidean distance in the RGB space or in a perceptually uniform one.
+     *
+     * Build it once per palette and query it for every pixel. It can be used
+     * directly as the color strategy of the quantization functions.
+     *
+     * The cells are always those of the RGB space. With a perceptually
+     * uniform space, the palette is converted once, and the candidates of a
+     * cell are found with the bounding box of the cell in that space.
+     *
+     * @see closestByColor
+     */
+    class PaletteTable{
+    public:
+        /**
+         * @brief Bits per channel used to index the grid of cells.
+         */
+        static const int CELL_BITS = 5;
+
+        /**
+         * @brief Build the table for a palette.
+         *
+         * @param palette Non empty palette
+         */
+        PaletteTable(const Palette& palette);
+
+        /**
+         * @brief Build the table for a palette, measuring the distances in a
+         * perceptually uniform space.
+         *
+         * @param palette Non empty palette
+         * @param space Space where the distances are measured
+         */
+        PaletteTable(const Palette& palette, LabSpace space);
+
+        /**
+         * @brief Return the color of the palette closest to the given one.
+         * If two colors are equally close, the first one in the palette is
+         * returned.
+         *
+         * @param color Reference color
+         * @return const RGB&
+         */
+        const RGB& closest(const RGB& color) const;
+
+        /**
+         * @brief Same as closest, to use the table as a color strategy.
+         *
+         * @param color Reference color
+         * @return RGB
+         */
+        inline RGB operator()(const RGB& color) const{
+            return closest(color);
+        }
+
+        /**
+         * @brief Replace each color of a row with the closest one of the
+         * palette. In a perceptually uniform space, the row is converted in
+         * batches.
+         *
+         * @param in Input colors
+         * @param out Output colors, which may be the input
+         * @param n Number of colors
+         */
+        void quantizeRow(const RGB* in, RGB* out, uint n) const;
+
+        /**
+         * @brief Palette indexed by the table.
+         *
+         * @return const Palette&
+         */
+        inline const Palette& getPalette() const{
+            return m_palette;
+        }
+
+    private:
+        void build();
+        uint closest(const RGB& color, const Lab& lab) const;
+
+        Palette m_palette;
+        bool m_perceptual;
+        LabSpace m_space;
+        // Palette in the perceptually uniform space, if used
+        std::vector<Lab> m_lab;
+        std::vector<uint> m_cellStart;
+        std::vector<uint> m_candidates;
+    };
+
+    /**
+     * @brief Precomputed nearest color lookup for a palette, using the
+     * difference of gray values.
+     *
+     * The gray value of each color is computed once and the palette is sorted
+     * by it. The range of gray values is split in levels, and each level keeps
+     * the range of sorted colors that can be the closest to a value inside it.
+     *
+     * @see closestByBrightness
+     */
+    class GrayTable{
+    public:
+        /**
+         * @brief Number of levels in which the gray values are split.
+         */
+        static const int LEVELS = 4096;
+
+        /**
+         * @brief Build the table for a palette.
+         *
+         * @param palette Non empty palette
+         */
+        GrayTable(const Palette& palette);
+
+        /**
+         * @brief Return the color of the palette with the gray value closest
+         * to the one of the given color. If two colors are equally close, the
+         * first one in the palette is returned.
+         *
+         * @param color Reference color
+         * @return const RGB&
+         */
+        const RGB& closest(const RGB& color) const;
+
+        /**
+         * @brief Same as closest, to use the table as a color strategy.
+         *
+         * @param color Reference color
+         * @return RGB
+         */
+        inline RGB operator()(const RGB& color) const{
+            return closest(color);
+        }
+
+        /**
+         * @brief Replace each color of a row with the closest one of the
+         * palette, computing the gray values of the row in batches.
+         *
+         * @param in Input colors
+         * @param out Output colors, which may be the input
+         * @param n Number of colors
+         */
+        void quantizeRow(const RGB* in, RGB* out, uint n) const;
+
+        /**
+         * @brief Palette indexed by the table.
+         *
+         * @return const Palette&
+         */
+        inline const Palette& getPalette() const{
+            return m_palette;
+        }
+
+    private:
+        const RGB& closest(float key) const;
+
+        Palette m_palette;
+        // Gray values of the queries and the palette are computed alike
+        const Luminance* m_luminance;
+        // Gray values in ascending order and the palette index of each one
+        std::vector<float> m_keys;
+        std::vector<uint> m_order;
+        // First and last sorted position that may be the closest in a level
+        std::vector<uint> m_levelFirst, m_levelLast;
+    };
+}
+
+#endif
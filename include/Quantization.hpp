@@ -1,50 +1,171 @@
 #ifndef __MIPA_QUANTIZATION_HPP__
 #define __MIPA_QUANTIZATION_HPP__
 
+#include <atomic>
 #include <cmath>
+#include <memory>
 
 #include <SFML/Graphics.hpp>
 
+#include "ImageView.hpp"
 #include "Palette.hpp"
+#include "PaletteScan.hpp"
+#include "PaletteTable.hpp"
+#include "ThreadPool.hpp"
 
 namespace mipa{
+    /**
+     * @brief Run a function over bands of rows of an image, in parallel if a
+     * pool is given.
+     * 
+     * @param image Image to split
+     * @param pool Threads to use, or nullptr to process it all in this one
+     * @param band Function that processes the rows [begin, end)
+     */
+    template <typename B>
+    void forEachBand(ImageView image, ThreadPool* pool, const B& band){
+        if(pool == nullptr || pool->size() == 1){
+            band(0u, image.height);
+        }else{
+            pool->parallelFor(image.height, band);
+        }
+    }
+
     template <typename F>
-    void directQuantize(sf::Image& image, const F& quant){
-        sf::Vector2u imgSize = image.getSize();        
-        for(uint y = 0; y < imgSize.y; y++){
-            for(uint x = 0; x < imgSize.x; x++){
-                image.setPixel(x, y, quant(image.getPixel(x, y)));
+    void directQuantize(ImageView image, const F& quant, ThreadPool* pool = nullptr){
+        forEachBand(image, pool, [&](uint begin, uint end){
+            for(uint y = begin; y < end; y++){
+                RGB* row = image.row(y);
+                for(uint x = 0; x < image.width; x++){
+                    row[x] = quant(row[x]);
+                }
             }
-        }
+        });
     }
     template <typename F>
-    void ditherFloydSteinberg(sf::Image& image, const F& quant, float threshold = 0){
-        sf::Vector2u imgSize = image.getSize();        
-        for(uint y = 0; y < imgSize.y; y++){
-            for(uint x = 0; x < imgSize.x; x++){
-                RGB oldColor = image.getPixel(x,y);
+    void directQuantize(sf::Image& image, const F& quant){
+        directQuantize(view(image), quant);
+    }
+
+    /**
+     * @brief Quantize the image with a palette scan, a whole row at a time.
+     * 
+     * @param image Image to quantize
+     * @param scan Palette to take the colors from
+     */
+    void directQuantize(ImageView image, const PaletteScan& scan, ThreadPool* pool = nullptr);
+    void directQuantize(sf::Image& image, const PaletteScan& scan);
+
+    /**
+     * @brief Quantize the image with a palette table, a whole row at a time.
+     * 
+     * @param image Image to quantize
+     * @param table Palette to take the colors from
+     */
+    void directQuantize(ImageView image, const PaletteTable& table, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Quantize the image with a gray table, a whole row at a time.
+     * 
+     * @param image Image to quantize
+     * @param table Palette to take the colors from
+     */
+    void directQuantize(ImageView image, const GrayTable& table, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Quantize the image propagating the error of each pixel to its
+     * neighbours, with the Floyd-Steinberg algorithm.
+     * 
+     * The error is accumulated in two rows of floats, the one being
+     * processed and the next one, instead of in the image. That way each
+     * pixel is read and written once, and the error is not rounded nor
+     * clipped until it is added to the color to quantize.
+     * 
+     * The error of a pixel goes to the next one in its row and to three in
+     * the next row, so a row can be processed while the previous one is
+     * still going, as long as it stays three pixels behind. With a pool, the
+     * rows are processed in parallel following that wavefront, and the
+     * result is the same as the serial one.
+     * 
+     * @param image Image to quantize
+     * @param quant Color strategy
+     * @param threshold Minimum error to propagate
+     * @param pool Threads to use, or nullptr to process it all in this one
+     */
+    template <typename F>
+    void ditherFloydSteinberg(ImageView image, const F& quant, float threshold = 0, ThreadPool* pool = nullptr){
+        // Error rows, with a padding pixel at each side that is written but
+        // never read. Row y reads and clears the error of its pixels from
+        // errors[y % 2] and adds error to errors[(y+1) % 2], which the
+        // previous row has already cleared
+        const uint stride = 3 * (image.width + 2);
+        std::vector<float> errors(2 * stride, 0.f);
+        // Pixels finished in each row. Pixel x of a row waits for pixel x+2
+        // of the previous one, which is the last one that adds error to the
+        // pixels x and x+1 of this row. Only used in parallel
+        std::unique_ptr<std::atomic<uint>[]> progress;
+        auto ditherRow = [&](uint y){
+            RGB* row = image.row(y);
+            float* err = errors.data() + (y % 2) * stride + 3;
+            float* nextErr = errors.data() + ((y + 1) % 2) * stride + 3;
+            const std::atomic<uint>* above = progress && y > 0 ? &progress[y - 1] : nullptr;
+            uint available = 0;
+            for(uint x = 0; x < image.width; x++){
+                if(above != nullptr && available < std::min(x + 3, image.width)){
+                    available = waitAtLeast(*above, std::min(x + 3, image.width));
+                }
+                float* e = err + 3 * x;
+                float r = std::max(0.f, std::min(255.f, row[x].r + e[0]));
+                float g = std::max(0.f, std::min(255.f, row[x].g + e[1]));
+                float b = std::max(0.f, std::min(255.f, row[x].b + e[2]));
+                e[0] = e[1] = e[2] = 0;
+                RGB oldColor(r + 0.5f, g + 0.5f, b + 0.5f, row[x].a);
                 RGB newColor = quant(oldColor);
-                image.setPixel(x,y,newColor); 
-                float err = rgbSquaredDistance(oldColor, newColor);
-                if (err > threshold * threshold){
-                    float rErr = (float)oldColor.r - newColor.r;
-                    float gErr = (float)oldColor.g - newColor.g;
-                    float bErr = (float)oldColor.b - newColor.b;
-                    auto updatePixel = [&](uint xi, uint yi, float t){
-                        if(xi >= imgSize.x || yi >= imgSize.y) return; // unsigned so negative overflow
-                        RGB p = image.getPixel(xi, yi);
-                        p.r = std::max(0.f, std::min(255.f, (float)p.r + (rErr * t)));
-                        p.g = std::max(0.f, std::min(255.f, (float)p.g + (gErr * t)));
-                        p.b = std::max(0.f, std::min(255.f, (float)p.b + (bErr * t)));
-                        image.setPixel(xi, yi, p);
-                    };
-                    updatePixel(x+1, y+1, 1.f/16);
-                    updatePixel(x-1, y+1, 3.f/16);
-                    updatePixel(x, y+1, 5.f/16);
-                    updatePixel(x+1, y, 7.f/16);
+                row[x] = newColor;
+                float rErr = r - newColor.r;
+                float gErr = g - newColor.g;
+                float bErr = b - newColor.b;
+                if(rErr * rErr + gErr * gErr + bErr * bErr > threshold * threshold){
+                    float* ne = nextErr + 3 * x;
+                    ne[3] += rErr * (1.f/16);
+                    ne[4] += gErr * (1.f/16);
+                    ne[5] += bErr * (1.f/16);
+                    ne[-3] += rErr * (3.f/16);
+                    ne[-2] += gErr * (3.f/16);
+                    ne[-1] += bErr * (3.f/16);
+                    ne[0] += rErr * (5.f/16);
+                    ne[1] += gErr * (5.f/16);
+                    ne[2] += bErr * (5.f/16);
+                    e[3] += rErr * (7.f/16);
+                    e[4] += gErr * (7.f/16);
+                    e[5] += bErr * (7.f/16);
+                }
+                if(progress){
+                    progress[y].store(x + 1, std::memory_order_release);
                 }
             }
+        };
+        if(pool == nullptr || pool->size() == 1 || image.height < 2){
+            for(uint y = 0; y < image.height; y++){
+                ditherRow(y);
+            }
+            return;
+        }
+        progress.reset(new std::atomic<uint>[image.height]);
+        for(uint y = 0; y < image.height; y++){
+            progress[y].store(0, std::memory_order_relaxed);
         }
+        // Rows are taken in order, so the previous one is always in progress
+        std::atomic<uint> nextRow(0);
+        pool->run([&](uint){
+            for(uint y = nextRow++; y < image.height; y = nextRow++){
+                ditherRow(y);
+            }
+        });
+    }
+    template <typename F>
+    void ditherFloydSteinberg(sf::Image& image, const F& quant, float threshold = 0){
+        ditherFloydSteinberg(view(image), quant, threshold);
     }
 
     typedef struct{
@@ -58,30 +179,76 @@ namespace mipa{
     extern const std::map<std::string, Matrix> matrices;
 
     template <typename F>
-    void ditherOrdered(sf::Image& image, const F& quant, const Matrix& m, double sparsity, float threshold = 0){
+    void ditherOrdered(ImageView image, const F& quant, const Matrix& m, double sparsity, float threshold = 0, ThreadPool* pool = nullptr){
         double N = m.getHeight() * m.getWidth();
-        sf::Vector2u imgSize = image.getSize();
-        for(uint y = 0; y < imgSize.y; y++){
-            for(uint x = 0; x < imgSize.x; x++){
-                RGB oldColor = image.getPixel(x,y);
-                double mij = m.get(y % m.getHeight(), x % m.getWidth()) / N - 0.5;
-                auto clamp = [](int x)->int{return std::min(255,std::max(0,x));};
-                RGB interColor;
-                interColor.r = clamp((double)oldColor.r + sparsity * mij);
-                interColor.g = clamp((double)oldColor.g + sparsity * mij);
-                interColor.b = clamp((double)oldColor.b + sparsity * mij);
-                RGB newColor = quant(interColor);
-                newColor.a = oldColor.a;
-                RGB quantOldColor = quant(oldColor);
-                float err = rgbDistance(oldColor, newColor);
-                if(err > threshold * threshold){
-                    image.setPixel(x,y, newColor);
-                }else{
-                    image.setPixel(x,y, quantOldColor);
+        auto clamp = [](int x)->int{return std::min(255,std::max(0,x));};
+        // Each pixel only depends on itself, so the rows can go in any order
+        forEachBand(image, pool, [&](uint begin, uint end){
+            for(uint y = begin; y < end; y++){
+                RGB* row = image.row(y);
+                for(uint x = 0; x < image.width; x++){
+                    RGB oldColor = row[x];
+                    double mij = m.get(y % m.getHeight(), x % m.getWidth()) / N - 0.5;
+                    RGB interColor;
+                    interColor.r = clamp((double)oldColor.r + sparsity * mij);
+                    interColor.g = clamp((double)oldColor.g + sparsity * mij);
+                    interColor.b = clamp((double)oldColor.b + sparsity * mij);
+                    RGB newColor = quant(interColor);
+                    newColor.a = oldColor.a;
+                    float err = rgbDistance(oldColor, newColor);
+                    if(err > threshold * threshold){
+                        row[x] = newColor;
+                    }else{
+                        row[x] = quant(oldColor);
+                    }
                 }
-
+            }
+        });
+    }
+    /**
+     * @brief Same as ditherOrdered, for a matrix with a size known at compile
+     * time, so the offsets of the matrix are precomputed and the color
+     * strategy can be inlined.
+     * 
+     * @tparam H Height of the matrix
+     * @tparam W Width of the matrix
+     */
+    template <uint H, uint W, typename F>
+    void ditherOrderedFixed(ImageView image, const F& quant, const Matrix& m, double sparsity, float threshold = 0, ThreadPool* pool = nullptr){
+        double N = H * W;
+        double offsets[H][W];
+        for(uint r = 0; r < H; r++){
+            for(uint c = 0; c < W; c++){
+                offsets[r][c] = sparsity * (m.get(r, c) / N - 0.5);
             }
         }
+        auto clamp = [](int x)->int{return std::min(255,std::max(0,x));};
+        forEachBand(image, pool, [&](uint begin, uint end){
+            for(uint y = begin; y < end; y++){
+                RGB* row = image.row(y);
+                const double* rowOffsets = offsets[y % H];
+                for(uint x = 0; x < image.width; x++){
+                    RGB oldColor = row[x];
+                    double offset = rowOffsets[x % W];
+                    RGB interColor;
+                    interColor.r = clamp((double)oldColor.r + offset);
+                    interColor.g = clamp((double)oldColor.g + offset);
+                    interColor.b = clamp((double)oldColor.b + offset);
+                    RGB newColor = quant(interColor);
+                    newColor.a = oldColor.a;
+                    float err = rgbDistance(oldColor, newColor);
+                    if(err > threshold * threshold){
+                        row[x] = newColor;
+                    }else{
+                        row[x] = quant(oldColor);
+                    }
+                }
+            }
+        });
+    }
+    template <typename F>
+    void ditherOrdered(sf::Image& image, const F& quant, const Matrix& m, double sparsity, float threshold = 0){
+        ditherOrdered(view(image), quant, m, sparsity, threshold);
     }
 }
 
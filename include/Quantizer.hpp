@@ -0,0 +1,157 @@
+/**
+ * @file Quantizer.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains the color quantization strategies and the
+ * dispatch of the quantization and dithering algorithms.
+ *
+ * The quantization functions are templates, so the color strategy can be
+ * inlined in the loop over the pixels. The Quantizer class chooses, once,
+ * the function instantiated for the combination of strategy, dithering
+ * method and matrix size given by the configuration, instead of calling the
+ * strategy through a std::function for every pixel.
+ *
+ */
+#ifndef __MIPA_QUANTIZER_HPP__
+#define __MIPA_QUANTIZER_HPP__
+
+#include <memory>
+
+#include <SFML/Graphics.hpp>
+
+#include "Color.hpp"
+#include "ImageView.hpp"
+#include "Palette.hpp"
+#include "Quantization.hpp"
+#include "ThreadPool.hpp"
+
+namespace mipa{
+    /**
+     * @brief Color strategy that leaves colors unchanged.
+     */
+    struct IdentityQuantizer{
+        inline RGB operator()(const RGB& rgb) const{
+            return rgb;
+        }
+    };
+
+    /**
+     * @brief Color strategy that reduces the bits used by each channel,
+     * rounding to the closest representable value.
+     */
+    struct BitQuantizer{
+        sf::Uint8 table[256];
+        /**
+         * @param bits Bits per channel, between 1 and 8
+         */
+        BitQuantizer(int bits);
+        inline RGB operator()(const RGB& rgb) const{
+            return RGB(table[rgb.r], table[rgb.g], table[rgb.b], rgb.a);
+        }
+    };
+
+    /**
+     * @brief Available color strategies.
+     */
+    typedef enum {
+        NO_QUANTIZATION, ///< Keep the colors. @see IdentityQuantizer
+        BIT_QUANTIZATION, ///< Reduce the bits per channel. @see BitQuantizer
+        CLOSEST_RGB, ///< Closest palette color. @see PaletteScan @see PaletteTable
+        CLOSEST_GRAY, ///< Palette color with the closest gray value. @see GrayTable
+        CLOSEST_OKLAB, ///< Closest palette color in the OKLab space. @see LabSpace
+        CLOSEST_LAB ///< Closest palette color in the CIE L*a*b* space. @see LabSpace
+    } QuantizerKind;
+
+    /**
+     * @brief Available dithering algorithms.
+     */
+    typedef enum {
+        NO_DITHERING, ///< @see directQuantize
+        FLOYDSTEINBERG_DITHERING, ///< @see ditherFloydSteinberg
+        ORDERED_DITHERING ///< @see ditherOrdered
+    } DitherMethod;
+
+    /**
+     * @brief Parameters of the dithering algorithms.
+     */
+    struct DitherSettings{
+        DitherMethod method = NO_DITHERING;
+        const Matrix* matrix = nullptr; ///< For ordered dithering
+        double sparsity = 0; ///< For ordered dithering
+        float threshold = 0;
+        ThreadPool* pool = nullptr; ///< Threads to use, if any
+    };
+
+    /**
+     * @brief Color strategy and dithering algorithm, resolved to a single
+     * specialized function.
+     */
+    class Quantizer{
+    public:
+        /**
+         * @brief Build a quantizer that keeps the colors.
+         *
+         * @param dithering Dithering algorithm
+         */
+        Quantizer(const DitherSettings& dithering);
+
+        /**
+         * @brief Build a quantizer that reduces the bits of each channel.
+         *
+         * @param bits Bits per channel, between 1 and 8
+         * @param dithering Dithering algorithm
+         */
+        Quantizer(int bits, const DitherSettings& dithering);
+
+        /**
+         * @brief Build a quantizer that takes the colors from a palette.
+         *
+         * @param kind CLOSEST_RGB, CLOSEST_GRAY, CLOSEST_OKLAB or CLOSEST_LAB
+         * @param palette Non empty palette
+         * @param dithering Dithering algorithm
+         */
+        Quantizer(QuantizerKind kind, const Palette& palette, const DitherSettings& dithering);
+
+        /**
+         * @brief Quantize and dither an image.
+         *
+         * @param image Image to process
+         */
+        inline void apply(ImageView image) const{
+            m_kernel(image, m_strategy.get(), m_dithering);
+        }
+
+        /**
+         * @brief Quantize and dither an image.
+         *
+         * @param image Image to process
+         */
+        inline void apply(sf::Image& image) const{
+            apply(view(image));
+        }
+
+        inline QuantizerKind getKind() const{
+            return m_kind;
+        }
+
+        inline const DitherSettings& getDithering() const{
+            return m_dithering;
+        }
+
+        /**
+         * @brief Function that processes an image with a given strategy.
+         */
+        typedef void (*Kernel)(ImageView, const void*, const DitherSettings&);
+
+    private:
+        template <typename Q>
+        void setStrategy(const std::shared_ptr<const Q>& strategy);
+
+        QuantizerKind m_kind;
+        DitherSettings m_dithering;
+        std::shared_ptr<const void> m_strategy;
+        Kernel m_kernel;
+    };
+}
+
+#endif
@@ -0,0 +1,439 @@
+/**
+ * @file Scaling.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains the functions to reduce the size of an image and
+ * to normalize its colors.
+ *
+ * The image is reduced by splitting it in blocks, one per pixel of the
+ * result, and choosing a color for each block with a pixel selector:
+ *
+ * - "avg": Average color of the block.
+ * - "med": Color with the median gray value.
+ * - "min": Darkest color.
+ * - "max": Lightest color.
+ * - "area": Average of the source weighted by how much of each pixel the
+ *   block covers, with blocks that don't overlap.
+ * - "center": Pixel at the center of the block.
+ * - "sampled_avg": Average color of a few pixels of the block.
+ * - "sampled_med": Color with the median gray value of a few pixels of the
+ *   block.
+ *
+ * The gray based selectors don't sort the blocks. Min and max are found with
+ * a linear scan, and the median with a histogram of gray keys, so only
+ * the colors in the bin of the median have to be compared. The area
+ * selector is separable: each row is reduced with fixed point weights, and
+ * the reduced rows are then added up with the weights of the rows.
+ *
+ * The sampling selectors read a fixed number of pixels of each block, so
+ * their cost depends only on the size of the output. The samples are spread
+ * over a grid covering the block, each at a random place of its cell that is
+ * the same in every run.
+ *
+ */
+#ifndef __MIPA_SCALING_HPP__
+#define __MIPA_SCALING_HPP__
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <SFML/Graphics.hpp>
+
+#include "Color.hpp"
+#include "ImageView.hpp"
+#include "IntegralImage.hpp"
+#include "StripReader.hpp"
+#include "ThreadPool.hpp"
+
+namespace mipa{
+    /**
+     * @brief Lookup table applied to each channel of a color. The alpha is
+     * kept.
+     *
+     * Maps that stretch each channel linearly also keep its parameters, so
+     * rows can be remapped with vector multiplications instead of lookups.
+     */
+    struct ChannelMap{
+        sf::Uint8 r[256];
+        sf::Uint8 g[256];
+        sf::Uint8 b[256];
+        /// Whether each value v of the channel c is mapped to
+        /// min(255, (max(v - offset[c], 0) * scale[c]) >> 16)
+        bool linear = false;
+        sf::Uint8 offset[3];
+        uint32_t scale[3];
+        inline RGB operator()(const RGB& color) const{
+            return RGB(r[color.r], g[color.g], b[color.b], color.a);
+        }
+    };
+
+    /**
+     * @brief Sort key of the gray based pixel selectors: the integer gray key
+     * of a color, and the color packed as 0xRRGGBBAA to break ties.
+     * @see Luminance
+     */
+    typedef std::pair<uint32_t, uint32_t> GrayKey;
+
+    /**
+     * @brief Part of each source pixel covered by each pixel of the output,
+     * in one dimension, used by the "area" selector.
+     */
+    struct Coverage{
+        /**
+         * @brief Compute the coverage of a reduction, reusing the memory
+         * when possible.
+         *
+         * @param size Pixels of the source
+         * @param outSize Pixels of the output
+         */
+        void build(uint size, uint outSize);
+
+        // Number of source pixels weighted for each output pixel
+        uint taps;
+        // First source pixel of each output pixel. The taps after it are
+        // always inside the source
+        std::vector<uint> first;
+        // taps weights of each output pixel, out of 1 << 14
+        std::vector<int16_t> weights;
+    };
+
+    /**
+     * @brief Memory reused by pixelize between blocks, rows and images.
+     *
+     * The buffers grow to the biggest size seen and are never shrunk, so
+     * once an image of a given size has been processed, processing it again
+     * doesn't allocate.
+     */
+    class PixelizeScratch{
+    public:
+        PixelizeScratch();
+
+        /**
+         * @brief Make room for the buffers of several threads.
+         *
+         * Call it before splitting the work, as it's not thread safe.
+         *
+         * @param workers Number of threads
+         * @param band Pixels of the biggest band of rows
+         * @param block Pixels of the biggest block
+         * @param copies Whether the threads need a copy of their band
+         */
+        void reserve(uint workers, size_t band, size_t block, bool copies = false);
+
+        /**
+         * @brief Make room for the buffers of the "area" selector of several
+         * threads. Not thread safe either.
+         *
+         * @param workers Number of threads
+         * @param band Pixels of the biggest band of rows, if the threads
+         * need a copy of it, or 0
+         * @param row Pixels of the part of an output row of each thread
+         */
+        void reserveArea(uint workers, size_t band, size_t row);
+
+        /**
+         * @brief Buffer of gray keys of a thread. @see reserve
+         *
+         * @param worker Index of the thread
+         * @return uint32_t*
+         */
+        inline uint32_t* grays(uint worker){
+            return m_workers[worker].grays.data();
+        }
+
+        /**
+         * @brief Buffer of sort keys of a thread. @see reserve
+         *
+         * @param worker Index of the thread
+         * @return GrayKey*
+         */
+        inline GrayKey* keys(uint worker){
+            return m_workers[worker].keys.data();
+        }
+
+        /**
+         * @brief Buffer for a copy of a band of rows of a thread.
+         * @see reserve
+         *
+         * @param worker Index of the thread
+         * @return RGB*
+         */
+        inline RGB* band(uint worker){
+            return m_workers[worker].band.data();
+        }
+
+        /**
+         * @brief Buffer for a reduced row of a thread, with 4 channels per
+         * pixel. @see reserveArea
+         *
+         * @param worker Index of the thread
+         * @return int16_t*
+         */
+        inline int16_t* filtered(uint worker){
+            return m_workers[worker].filtered.data();
+        }
+
+        /**
+         * @brief Buffer for the sums of an output row of a thread, with 4
+         * channels per pixel. @see reserveArea
+         *
+         * @param worker Index of the thread
+         * @return int32_t*
+         */
+        inline int32_t* sums(uint worker){
+            return m_workers[worker].sums.data();
+        }
+
+        /**
+         * @brief Return a buffer for rows of an image, shared by all the
+         * threads.
+         *
+         * @param pixels Number of pixels
+         * @return RGB*
+         */
+        RGB* strip(size_t pixels);
+
+        /**
+         * @brief Return the summed-area table rebuilt for an image.
+         *
+         * @param image Source image
+         * @param pool Threads to use, or nullptr to build it in this one
+         * @return const IntegralImage&
+         */
+        const IntegralImage& table(ConstImageView image, ThreadPool* pool = nullptr);
+
+        /**
+         * @brief Return the coverage of the columns and the rows of a
+         * reduction, rebuilt for it.
+         *
+         * @param width Width of the source
+         * @param height Height of the source
+         * @param out Size of the output
+         * @return const Coverage* The coverage of the columns, followed by
+         * the one of the rows
+         */
+        const Coverage* coverage(uint width, uint height, sf::Vector2u out);
+
+        /**
+         * @brief Number of times the buffers had to grow.
+         *
+         * @return uint
+         */
+        inline uint getAllocations() const{
+            return m_allocations;
+        }
+
+    private:
+        template <typename T>
+        void reserve(std::vector<T>& buffer, size_t size);
+
+        struct Worker{
+            std::vector<uint32_t> grays;
+            std::vector<GrayKey> keys;
+            std::vector<RGB> band;
+            std::vector<int16_t> filtered;
+            std::vector<int32_t> sums;
+        };
+
+        std::vector<Worker> m_workers;
+        std::vector<RGB> m_strip;
+        IntegralImage m_table;
+        Coverage m_coverage[2];
+        uint m_allocations;
+    };
+
+    /**
+     * @brief Names of the available pixel selectors.
+     *
+     * @return const std::vector<std::string>&
+     */
+    const std::vector<std::string>& pixelSelectors();
+
+    /**
+     * @brief Compute the size of an image reduced to fit in a maximum size,
+     * keeping the aspect ratio.
+     *
+     * @param size Original size
+     * @param max_width Maximum width
+     * @param max_height Maximum height
+     * @return sf::Vector2u
+     */
+    sf::Vector2u pixelizedSize(sf::Vector2u size, uint max_width, uint max_height);
+
+    /**
+     * @brief Reduce an image into another one, averaging each block with the
+     * summed-area table of the source.
+     *
+     * The same table can be used to reduce the source to several sizes.
+     *
+     * @param table Summed-area table of the source image
+     * @param out Output image, smaller than the source
+     * @param pool Threads to use, or nullptr to process it all in this one
+     */
+    void pixelize(const IntegralImage& table, ImageView out, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Reduce an image into another one.
+     *
+     * The blocks of the source are as big as needed to cover it with the
+     * pixels of the output.
+     *
+     * @param image Source image
+     * @param out Output image, smaller than the source
+     * @param selector Pixel selector: "avg", "med", "min", "max", "area",
+     * "center", "sampled_avg" or "sampled_med"
+     * @param scratch Memory to reuse, or nullptr to use a temporary one
+     * @param pool Threads to use, or nullptr to process it all in this one
+     * @param samples Pixels read from each block by the sampled selectors
+     * @throw std::runtime_error if the selector doesn't exist
+     */
+    void pixelize(ConstImageView image, ImageView out, const std::string& selector = "avg", PixelizeScratch* scratch = nullptr, ThreadPool* pool = nullptr, uint samples = 16);
+
+    /**
+     * @brief Return a copy of the image reduced to fit in a maximum size.
+     *
+     * @param image Source image
+     * @param max_width Maximum width
+     * @param max_height Maximum height
+     * @param selector Pixel selector: "avg", "med", "min", "max", "area",
+     * "center", "sampled_avg" or "sampled_med"
+     * @param scratch Memory to reuse, or nullptr to use a temporary one
+     * @param pool Threads to use, or nullptr to process it all in this one
+     * @param samples Pixels read from each block by the sampled selectors
+     * @return sf::Image
+     * @throw std::runtime_error if the selector doesn't exist
+     * @see pixelizedSize
+     */
+    sf::Image pixelize(const sf::Image& image, uint max_width, uint max_height, const std::string& selector = "avg", PixelizeScratch* scratch = nullptr, ThreadPool* pool = nullptr, uint samples = 16);
+
+    /**
+     * @brief Reduce an image into another one a band of rows at a time,
+     * without any buffer as big as the source.
+     *
+     * Each band of rows is reduced into a row of the output while it's in
+     * cache. If a channel map is given, it's applied to a copy of the band
+     * before reducing it, with the same result as remapping the whole
+     * source first. The "avg" selector sums the blocks directly instead of
+     * building a summed-area table.
+     *
+     * @param image Source image
+     * @param out Output image, smaller than the source
+     * @param selector Pixel selector: "avg", "med", "min", "max", "area",
+     * "center", "sampled_avg" or "sampled_med"
+     * @param map Channel map to apply to the source, or nullptr
+     * @param scratch Memory to reuse, or nullptr to use a temporary one
+     * @param pool Threads to use, or nullptr to process it all in this one
+     * @param samples Pixels read from each block by the sampled selectors
+     * @throw std::runtime_error if the selector doesn't exist
+     */
+    void pixelizeBands(ConstImageView image, ImageView out, const std::string& selector, const ChannelMap* map = nullptr, PixelizeScratch* scratch = nullptr, ThreadPool* pool = nullptr, uint samples = 16);
+
+    /**
+     * @brief Reduce an image into another one while it's decoded.
+     *
+     * Only the rows of the band under one row of the output are held in
+     * memory. The pixels of each output row are split between the threads.
+     * If a channel map is given, it's applied to the rows as they are read.
+     *
+     * @param reader Reader of the source image, at its first row
+     * @param out Output image, smaller than the source
+     * @param selector Pixel selector: "avg", "med", "min", "max", "area",
+     * "center", "sampled_avg" or "sampled_med"
+     * @param map Channel map to apply to the source, or nullptr
+     * @param scratch Memory to reuse, or nullptr to use a temporary one
+     * @param pool Threads to use, or nullptr to process it all in this one
+     * @param samples Pixels read from each block by the sampled selectors
+     * @throw std::runtime_error if the selector doesn't exist or the image
+     * can't be decoded
+     */
+    void pixelize(StripReader& reader, ImageView out, const std::string& selector, const ChannelMap* map = nullptr, PixelizeScratch* scratch = nullptr, ThreadPool* pool = nullptr, uint samples = 16);
+
+    /**
+     * @brief Widen the range of each channel to include the values of some
+     * pixels. The alpha is ignored.
+     *
+     * @param pixels Pixels to measure
+     * @param n Number of pixels
+     * @param min Minimum value of each channel, updated
+     * @param max Maximum value of each channel, updated
+     */
+    void channelRange(const RGB* pixels, size_t n, RGB& min, RGB& max);
+
+    /**
+     * @brief Compute the map that stretches each channel from a range of
+     * values to [0, 255]. Channels with a single value are kept.
+     *
+     * @param min Minimum value of each channel
+     * @param max Maximum value of each channel
+     * @return ChannelMap
+     */
+    ChannelMap normalization(const RGB& min, const RGB& max);
+
+    /**
+     * @brief Compute the map that stretches each channel of an image so its
+     * values cover the range [0, 255].
+     *
+     * @param image Image to measure
+     * @param pool Threads to use, or nullptr to process it all in this one
+     * @return ChannelMap
+     */
+    ChannelMap normalization(ConstImageView image, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Compute the map that stretches each channel of an image so its
+     * values cover the range [0, 255], reading it by strips.
+     *
+     * @param reader Reader of the image, at its first row. It's left at the
+     * end of the image
+     * @param scratch Memory to reuse, or nullptr to use a temporary one
+     * @return ChannelMap
+     * @throw std::runtime_error if the image can't be decoded
+     */
+    ChannelMap normalization(StripReader& reader, PixelizeScratch* scratch = nullptr);
+
+    /**
+     * @brief Decode an image by strips and compute the map that stretches
+     * each channel so its values cover the range [0, 255]. Each strip is
+     * measured right after it's decoded, so the image isn't read again.
+     *
+     * @param reader Reader of the image, at its first row. It's left at the
+     * end of the image
+     * @param image Image of the size of the reader, where it's decoded
+     * @return ChannelMap
+     * @throw std::runtime_error if the image doesn't have the size of the
+     * reader or can't be decoded
+     */
+    ChannelMap normalization(StripReader& reader, ImageView image);
+
+    /**
+     * @brief Apply a channel map to every pixel of an image, with vector
+     * multiplications if the map is linear.
+     *
+     * @param image Image to change
+     * @param map Map to apply
+     * @param pool Threads to use, or nullptr to process it all in this one
+     */
+    void remap(ImageView image, const ChannelMap& map, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Stretch each channel so its values cover the range [0, 255].
+     *
+     * @param image Image to normalize
+     * @param pool Threads to use, or nullptr to process it all in this one
+     * @see normalization
+     */
+    void normalize(ImageView image, ThreadPool* pool = nullptr);
+
+    /**
+     * @brief Stretch each channel so its values cover the range [0, 255].
+     *
+     * @param image Image to normalize
+     * @param pool Threads to use, or nullptr to process it all in this one
+     * @see normalization
+     */
+    void normalize(sf::Image& image, ThreadPool* pool = nullptr);
+}
+
+#endif
@@ -0,0 +1,127 @@
+/**
+ * @file StripReader.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains the decoders that read an image a few rows at a
+ * time.
+ *
+ * Loading an image with SFML decodes all of it in memory before anything
+ * else can be done, which takes gigabytes for very big scans that are going
+ * to be reduced to a sprite. The strip readers decode PNG and JPEG files row
+ * by row, so the rows can be reduced as they come and dropped. JPEG files
+ * can also be decoded at 1/2, 1/4 or 1/8 of their size by the inverse DCT
+ * itself, which is much faster than decoding them whole.
+ *
+ */
+#ifndef __MIPA_STRIPREADER_HPP__
+#define __MIPA_STRIPREADER_HPP__
+
+#include <memory>
+#include <string>
+
+#include "Color.hpp"
+
+namespace mipa{
+    /**
+     * @brief Sequential decoder of the rows of an image, from top to bottom.
+     */
+    class StripReader{
+    public:
+        /**
+         * @brief Open an image to read it by rows.
+         *
+         * @param path Path of a PNG or JPEG file
+         * @return std::unique_ptr<StripReader> The reader, or nullptr if the
+         * file is in a format that can't be read by rows, like other formats
+         * or interlaced PNG.
+         * @throw std::runtime_error if the file can't be opened or is damaged
+         */
+        static std::unique_ptr<StripReader> open(const std::string& path);
+
+        /**
+         * @brief Whether a file is in a format that can be decoded smaller,
+         * judging by its first bytes. @see scaleTo
+         *
+         * @param path Path of the file
+         * @return bool False too if the file can't be read
+         */
+        static bool isScalable(const std::string& path);
+
+        virtual ~StripReader();
+
+        /**
+         * @brief Decode the next rows of the image.
+         *
+         * @param rows Room for count rows of getWidth() pixels, one after
+         * another
+         * @param count Number of rows, no more than the ones left
+         * @throw std::runtime_error if the file is damaged
+         */
+        virtual void read(RGB* rows, uint count) = 0;
+
+        /**
+         * @brief Decode a smaller version of the image, if the format allows
+         * it, as long as it's at least of the given size. Call it before
+         * reading any row.
+         *
+         * @param minWidth Minimum width of the decoded image
+         * @param minHeight Minimum height of the decoded image
+         * @return bool Whether the image will be decoded smaller
+         * @throw std::runtime_error if the file can't be opened again
+         */
+        virtual bool scaleTo(uint minWidth, uint minHeight);
+
+        /**
+         * @brief Go back to the first row.
+         *
+         * @throw std::runtime_error if the file can't be opened again
+         */
+        virtual void rewind() = 0;
+
+        inline uint getWidth() const{
+            return m_width;
+        }
+
+        inline uint getHeight() const{
+            return m_height;
+        }
+
+        /**
+         * @brief Width of the image before scaling it. @see scaleTo
+         *
+         * @return uint
+         */
+        inline uint getFullWidth() const{
+            return m_fullWidth;
+        }
+
+        /**
+         * @brief Height of the image before scaling it. @see scaleTo
+         *
+         * @return uint
+         */
+        inline uint getFullHeight() const{
+            return m_fullHeight;
+        }
+
+        /**
+         * @brief Index of the next row to read.
+         *
+         * @return uint
+         */
+        inline uint getRow() const{
+            return m_row;
+        }
+
+    protected:
+        StripReader();
+
+        uint m_width;
+        uint m_height;
+        uint m_fullWidth;
+        uint m_fullHeight;
+        uint m_row;
+    };
+}
+
+#endif
@@ -0,0 +1,112 @@
+/**
+ * @file ThreadPool.hpp
+ * @copyright MIT License
+ * @author Miguel Mejía Jiménez
+ * @brief This file contains a small pool of threads to split image
+ * processing work.
+ *
+ * The threads are created once and wait for work between calls, so
+ * processing several images or several stages doesn't pay for creating
+ * them again. The thread that submits the work takes part on it too.
+ *
+ */
+#ifndef __MIPA_THREADPOOL_HPP__
+#define __MIPA_THREADPOOL_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace mipa{
+    /**
+     * @brief Fixed set of threads that run the same task together.
+     */
+    class ThreadPool{
+    public:
+        /**
+         * @brief Create the threads of the pool.
+         *
+         * @param threads Number of threads, counting the calling one. 0 uses
+         * one per hardware thread.
+         */
+        explicit ThreadPool(uint threads = 0);
+
+        /**
+         * @brief Wait for the threads to finish.
+         */
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /**
+         * @brief Number of threads that run each task, counting the calling
+         * one.
+         *
+         * @return uint
+         */
+        inline uint size() const{
+            return m_workers.size() + 1;
+        }
+
+        /**
+         * @brief Run a task in every thread and wait for all of them to
+         * finish. If any of them throws, the exception is rethrown here.
+         *
+         * @param task Function that receives the index of the thread, from 0
+         * to size() - 1
+         */
+        void run(const std::function<void(uint)>& task);
+
+        /**
+         * @brief Split a range in contiguous bands, one per thread, and
+         * process them in parallel.
+         *
+         * @param count Size of the range [0, count)
+         * @param task Function that processes the range [begin, end)
+         */
+        void parallelFor(uint count, const std::function<void(uint, uint)>& task);
+
+    private:
+        void work(uint index);
+
+        std::vector<std::thread> m_workers;
+        std::mutex m_mutex;
+        std::condition_variable m_start, m_done;
+        const std::function<void(uint)>* m_task;
+        unsigned long m_generation;
+        uint m_pending;
+        bool m_stop;
+        std::exception_ptr m_error;
+    };
+
+    /**
+     * @brief Wait until a counter updated by another thread reaches a value.
+     * Spin for a short while, as the wait is expected to be short, and then
+     * yield the processor while waiting.
+     *
+     * @param counter Counter to watch
+     * @param target Minimum value to wait for
+     * @return uint Last value read, at least @p target
+     */
+    inline uint waitAtLeast(const std::atomic<uint>& counter, uint target){
+        const int SPINS = 1024;
+        uint value = counter.load(std::memory_order_acquire);
+        for(int i = 0; value < target && i < SPINS; i++){
+            value = counter.load(std::memory_order_acquire);
+        }
+        while(value < target){
+            std::this_thread::yield();
+            value = counter.load(std::memory_order_acquire);
+        }
+        return value;
+    }
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef __MIPA_VALUE__
 #define __MIPA_VALUE__
 
+#include <algorithm>
 #include <string>
 #include <sstream>
 
@@ -8,6 +9,7 @@
 
 #include "Color.hpp"
 #include "Palette.hpp"
+#include "PaletteIndex.hpp"
 #include "Quantization.hpp"
 
 namespace mipa{
@@ -95,6 +97,12 @@ namespace mipa{
         virtual RGB operator()(const RGB& rgb) const{
             return rgb;
         };
+        // Replace each color of a row, out may be in
+        virtual void quantizeRow(const RGB* in, RGB* out, uint n) const{
+            for(uint i = 0; i < n; i++){
+                out[i] = (*this)(in[i]);
+            }
+        }
         virtual std::string toString() const{
             return "{Empty Color Strategy}";
         };
@@ -106,24 +114,23 @@ namespace mipa{
         };
     };
     struct PaletteColorStrategyValue: public ColorStrategyValue{
-        Palette palette;
-        RGB (*picker)(const Palette& p, const RGB& in);
+        PaletteIndex index;
+        inline PaletteColorStrategyValue(const Palette& p, ColorMetric metric):
+            ColorStrategyValue(), index(p, metric)
+            {}
         inline RGB operator()(const RGB& rgb) const override{
-            return picker(palette, rgb);
+            return index.closest(rgb);
         }
         inline std::string toString() const override{
             std::stringstream ss;
-            ss << "{Palette Picker " << PaletteValue(palette).toString() << "}";
+            ss << "{Palette Picker " << PaletteValue(index.getPalette()).toString() << "}";
             return ss.str();
         }
         inline Value* copy() const override{
-            auto pcsv = new PaletteColorStrategyValue;
-            pcsv->palette = palette;
-            pcsv->picker = picker;
-            return pcsv;
+            return new PaletteColorStrategyValue(*this);
         }
         virtual float recommended_sparsity() const{
-            return std::sqrt(palette.size());
+            return std::sqrt(index.getPalette().size());
         };
     };
     struct DiscreteRGBColorStrategyValue: public ColorStrategyValue{
@@ -156,16 +163,50 @@ namespace mipa{
         uint h_values;
         uint s_values;
         uint v_values;
+        // Quantized value of each fixed point hue, saturation and value
+        uint16_t hues[FIXED_HUES];
+        uint8_t saturations[256];
+        uint8_t values[256];
         inline DiscreteHSVColorStrategyValue(uint h, uint s, uint v):
             ColorStrategyValue(), h_values(360/h), s_values(100/s), v_values(100/v)
-            {}
+            {
+                // Hues in whole degrees, saturations and values in percent
+                for(uint x = 0; x < FIXED_HUES; x++){
+                    uint degrees = x * 360 / FIXED_HUES;
+                    degrees -= degrees % h_values;
+                    hues[x] = (degrees * FIXED_HUES + 180) / 360;
+                }
+                for(uint x = 0; x < 256; x++){
+                    uint percent = x * 100 / 255;
+                    saturations[x] = ((percent - percent % s_values) * 255 + 50) / 100;
+                    values[x] = ((percent - percent % v_values) * 255 + 50) / 100;
+                }
+            }
         inline RGB operator()(const RGB& rgb) const override{
-            HSV hsv = toHSV(rgb);
-            HSV out;
-            out.h = hsv.h - ((int)hsv.h % h_values);
-            out.s = hsv.s - (float)((int)(hsv.s * 100) % s_values)/100;
-            out.v = hsv.v - (float)((int)(hsv.v * 100) % v_values)/100;
-            return toRGB(out);
+            FixedHSV hsv = toFixedHSV(rgb);
+            hsv.h = hues[hsv.h];
+            hsv.s = saturations[hsv.s];
+            hsv.v = values[hsv.v];
+            return toRGB(hsv);
+        }
+        // Convert the row to fixed point HSV in batches
+        void quantizeRow(const RGB* in, RGB* out, uint n) const override{
+            const uint BATCH = 256;
+            uint16_t h[BATCH];
+            uint8_t s[BATCH], v[BATCH];
+            for(uint i = 0; i < n; i += BATCH){
+                uint count = std::min(BATCH, n - i);
+                toFixedHSV(in + i, h, s, v, count);
+                for(uint k = 0; k < count; k++){
+                    h[k] = hues[h[k]];
+                    s[k] = saturations[s[k]];
+                    v[k] = values[v[k]];
+                }
+                if(out != in){
+                    std::copy(in + i, in + i + count, out + i);
+                }
+                toRGB(h, s, v, out + i, count);
+            }
         }
         inline std::string toString() const override{
             std::stringstream ss;
@@ -187,7 +228,10 @@ namespace mipa{
     };
     struct DirectQuantizerValue: public QuantizerValue{
         void apply(sf::Image& img, ColorStrategyValue* strategy) const override{
-            directQuantize(img, strategy);
+            ImageView pixels = view(img);
+            for(uint y = 0; y < pixels.height; y++){
+                strategy->quantizeRow(pixels.row(y), pixels.row(y), pixels.width);
+            }
         }
         inline std::string toString() const override{
             return "{Direct Quantizer}";
@@ -204,7 +248,7 @@ namespace mipa{
             if(real_sparsity == -1){
                 real_sparsity = strategy->recommended_sparsity();
             }
-            ditherOrdered(img, strategy, matrices.at(matrixName), real_sparsity, threshold);
+            ditherOrdered(img, *strategy, matrices.at(matrixName), real_sparsity, threshold);
         }
         inline std::string toString() const override{
             return "{Ordered Dither: "+matrixName+"}";
@@ -216,7 +260,7 @@ namespace mipa{
     struct FSDitherQuantizerValue: public QuantizerValue{
         float threshold;
         void apply(sf::Image& img, ColorStrategyValue* strategy) const override{
-            ditherFloydSteinberg(img, strategy, threshold);
+            ditherFloydSteinberg(img, *strategy, threshold);
         }
         inline std::string toString() const override{
             return "{Error Propagation Dither}";
@@ -0,0 +1,256 @@
+#include "Benchmark.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "Color.hpp"
+#include "ImageView.hpp"
+#include "Palette.hpp"
+#include "PaletteScan.hpp"
+#include "Quantization.hpp"
+#include "Quantizer.hpp"
+#include "Scaling.hpp"
+
+namespace mipa{
+    namespace{
+        // Small and fast deterministic generator, so inputs are the same in
+        // every platform
+        struct XorShift{
+            uint32_t state;
+            inline XorShift(uint32_t seed): state(seed ? seed : 1){}
+            inline uint32_t next(){
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                return state;
+            }
+        };
+
+        inline sf::Uint8 clampChannel(float x){
+            return std::max(0.f, std::min(255.f, x));
+        }
+
+        Palette syntheticPalette(uint size, uint32_t seed){
+            XorShift rng(seed);
+            Palette palette;
+            for(uint i = 0; i < size; i++){
+                uint32_t v = rng.next();
+                palette.push_back(RGB(v >> 24, v >> 16, v >> 8));
+            }
+            return palette;
+        }
+
+        // Best time of several runs. The setup is not measured
+        template <typename S, typename R>
+        double bestTime(int repeat, const S& setup, const R& run){
+            double best = std::numeric_limits<double>::max();
+            for(int i = 0; i < repeat; i++){
+                setup();
+                auto start = std::chrono::steady_clock::now();
+                run();
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                best = std::min(best, elapsed.count());
+            }
+            return best;
+        }
+    }
+
+    sf::Image syntheticImage(const std::string& kind, uint width, uint height){
+        sf::Image image;
+        image.create(width, height);
+        ImageView pixels = view(image);
+        XorShift rng(width * 2654435761u ^ height);
+        if(kind == "noise"){
+            for(uint y = 0; y < height; y++){
+                RGB* row = pixels.row(y);
+                for(uint x = 0; x < width; x++){
+                    uint32_t v = rng.next();
+                    row[x] = RGB(v >> 24, v >> 16, v >> 8);
+                }
+            }
+        }else if(kind == "gradient"){
+            for(uint y = 0; y < height; y++){
+                RGB* row = pixels.row(y);
+                for(uint x = 0; x < width; x++){
+                    row[x] = RGB(
+                        255 * x / width,
+                        255 * y / height,
+                        255 * (x + y) / (width + height)
+                    );
+                }
+            }
+        }else if(kind == "photo"){
+            // Smooth lighting, a few flat shapes with sharp borders and grain
+            const int SHAPES = 12;
+            float cx[SHAPES], cy[SHAPES], radius[SHAPES];
+            RGB color[SHAPES];
+            for(int i = 0; i < SHAPES; i++){
+                cx[i] = (rng.next() % 1000) / 1000.f * width;
+                cy[i] = (rng.next() % 1000) / 1000.f * height;
+                radius[i] = (50 + rng.next() % 250) / 1000.f * std::min(width, height);
+                uint32_t v = rng.next();
+                color[i] = RGB(v >> 24, v >> 16, v >> 8);
+            }
+            for(uint y = 0; y < height; y++){
+                RGB* row = pixels.row(y);
+                float fy = (float)y / height;
+                for(uint x = 0; x < width; x++){
+                    float fx = (float)x / width;
+                    float r = 128 + 90 * std::sin(3.1f * fx + 1.3f * fy);
+                    float g = 128 + 90 * std::sin(2.3f * fy + 0.7f * fx + 1.f);
+                    float b = 128 + 90 * std::cos(1.7f * fx * fy + 2.f);
+                    for(int i = 0; i < SHAPES; i++){
+                        float dx = x - cx[i], dy = y - cy[i];
+                        if(dx * dx + dy * dy < radius[i] * radius[i]){
+                            r = (r + 3 * color[i].r) / 4;
+                            g = (g + 3 * color[i].g) / 4;
+                            b = (b + 3 * color[i].b) / 4;
+                        }
+                    }
+                    float grain = (int)(rng.next() % 17) - 8;
+                    row[x] = RGB(clampChannel(r + grain), clampChannel(g + grain), clampChannel(b + grain));
+                }
+            }
+        }else{
+            throw std::runtime_error("Unknown synthetic image: " + kind);
+        }
+        return image;
+    }
+
+    nlohmann::json benchmark(const nlohmann::json& options, ThreadPool& pool, const std::function<void(const std::string&)>& progress){
+        nlohmann::json config = {
+            {"megapixels", {1, 12, 48}},
+            {"inputs", {"noise", "gradient", "photo"}},
+            {"repeat", 3},
+            {"width", 64},
+            {"height", 64}
+        };
+        config.merge_patch(options);
+        int repeat = std::max(1, config["repeat"].get<int>());
+        uint max_width = config["width"].get<uint>();
+        uint max_height = config["height"].get<uint>();
+
+        // Color strategies measured, with the palettes of the closest_*
+        // strategies big enough to go through each search method
+        struct Strategy{
+            std::string name;
+            QuantizerKind kind;
+            int bits;
+            Palette palette;
+        };
+        std::vector<Strategy> strategies = {
+            {"none", NO_QUANTIZATION, 8, {}},
+            {"bit3", BIT_QUANTIZATION, 3, {}},
+            {"closest_rgb_16", CLOSEST_RGB, 8, syntheticPalette(16, 1)},
+            {"closest_rgb_256", CLOSEST_RGB, 8, syntheticPalette(256, 2)},
+            {"closest_gray_16", CLOSEST_GRAY, 8, syntheticPalette(16, 3)},
+            {"closest_oklab_16", CLOSEST_OKLAB, 8, syntheticPalette(16, 1)},
+            {"closest_oklab_256", CLOSEST_OKLAB, 8, syntheticPalette(256, 2)},
+            {"closest_lab_16", CLOSEST_LAB, 8, syntheticPalette(16, 1)},
+        };
+        struct Dithering{
+            std::string name;
+            DitherSettings settings;
+        };
+        std::vector<Dithering> ditherings;
+        DitherSettings settings;
+        settings.pool = &pool;
+        settings.method = NO_DITHERING;
+        ditherings.push_back({"none", settings});
+        settings.method = FLOYDSTEINBERG_DITHERING;
+        ditherings.push_back({"floydsteinberg", settings});
+        settings.method = ORDERED_DITHERING;
+        settings.sparsity = 32;
+        for(const auto& matrix: matrices){
+            settings.matrix = &matrix.second;
+            ditherings.push_back({"ordered_" + matrix.first, settings});
+        }
+
+        nlohmann::json results = nlohmann::json::array();
+        for(const auto& input: config["inputs"]){
+            for(const auto& megapixels: config["megapixels"]){
+                double mp = megapixels.get<double>();
+                uint width = std::max(1.0, std::round(std::sqrt(mp * 1e6 * 4 / 3)));
+                uint height = std::max(1u, width * 3 / 4);
+                double pixels = (double)width * height;
+                progress("Generating " + input.get<std::string>() + " " + std::to_string(width) + "x" + std::to_string(height));
+                sf::Image source = syntheticImage(input.get<std::string>(), width, height);
+                sf::Image work;
+
+                auto report = [&](const std::string& stage, const std::string& variant, double seconds){
+                    results.push_back({
+                        {"input", input},
+                        {"megapixels", pixels / 1e6},
+                        {"width", width},
+                        {"height", height},
+                        {"stage", stage},
+                        {"variant", variant},
+                        {"seconds", seconds},
+                        {"mpixels_per_second", pixels / 1e6 / seconds},
+                        {"ns_per_pixel", seconds * 1e9 / pixels}
+                    });
+                };
+                auto copySource = [&]{ work = source; };
+                auto nothing = []{};
+
+                sf::Vector2u outSize = pixelizedSize(source.getSize(), max_width, max_height);
+                sf::Image out;
+                out.create(outSize.x, outSize.y);
+                PixelizeScratch scratch;
+                for(const std::string& selector: pixelSelectors()){
+                    progress("pixelize " + selector);
+                    // Warm the scratch memory up, so the measured runs
+                    // shouldn't allocate
+                    pixelize(view(source), view(out), selector, &scratch, &pool);
+                    uint allocations = scratch.getAllocations();
+                    report("pixelize", selector, bestTime(repeat, nothing, [&]{
+                        pixelize(view(source), view(out), selector, &scratch, &pool);
+                    }));
+                    results.back()["allocations"] = scratch.getAllocations() - allocations;
+                }
+                for(const std::string& selector: pixelSelectors()){
+                    progress("pixelize bands " + selector);
+                    report("pixelize_bands", selector, bestTime(repeat, nothing, [&]{
+                        pixelizeBands(view(source), view(out), selector, nullptr, &scratch, &pool);
+                    }));
+                    progress("normalize and pixelize bands " + selector);
+                    report("pixelize_bands", selector + "/normalized", bestTime(repeat, nothing, [&]{
+                        ChannelMap map = normalization(view(source), &pool);
+                        pixelizeBands(view(source), view(out), selector, &map, &scratch, &pool);
+                    }));
+                }
+
+                progress("normalize");
+                report("normalize", "", bestTime(repeat, copySource, [&]{
+                    normalize(work, &pool);
+                }));
+
+                for(const Strategy& strategy: strategies){
+                    for(const Dithering& dithering: ditherings){
+                        std::string variant = strategy.name + "/" + dithering.name;
+                        progress("quantize " + variant);
+                        std::unique_ptr<Quantizer> quantizer;
+                        if(strategy.kind == NO_QUANTIZATION){
+                            quantizer.reset(new Quantizer(dithering.settings));
+                        }else if(strategy.kind == BIT_QUANTIZATION){
+                            quantizer.reset(new Quantizer(strategy.bits, dithering.settings));
+                        }else{
+                            quantizer.reset(new Quantizer(strategy.kind, strategy.palette, dithering.settings));
+                        }
+                        report("quantize", variant, bestTime(repeat, copySource, [&]{
+                            quantizer->apply(work);
+                        }));
+                    }
+                }
+            }
+        }
+        return {
+            {"threads", pool.size()},
+            {"instruction_set", PaletteScan::instructionSet()},
+            {"repeat", repeat},
+            {"results", results}
+        };
+    }
+}
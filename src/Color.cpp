@@ -1,13 +1,79 @@
 #include "Color.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <iomanip>
 #include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MIPA_X86_SIMD
+#include <immintrin.h>
+#endif
 
 namespace mipa{
     float RED_BRIGHTNESS = .241;
     float GREEN_BRIGHTNESS = .601;
     float BLUE_BRIGHTNESS = .068;
 
+    namespace{
+        std::atomic<const Luminance*> currentLuminance(nullptr);
+    }
+
+    Luminance::Luminance(float red, float green, float blue):
+        m_red(red),
+        m_green(green),
+        m_blue(blue)
+    {
+        // The biggest key, of white, must fit in 32 bits
+        double scale = 4294967040.0 / (255 * 255 * std::max(1e-6, (double)red + green + blue));
+        for(int v = 0; v < 256; v++){
+            // Same operations as the gray value used to do per color
+            m_r[v] = v * v * red;
+            m_g[v] = v * v * green;
+            m_b[v] = v * v * blue;
+            m_keyR[v] = std::max(0.0, std::round(v * v * red * scale));
+            m_keyG[v] = std::max(0.0, std::round(v * v * green * scale));
+            m_keyB[v] = std::max(0.0, std::round(v * v * blue * scale));
+        }
+    }
+
+    const Luminance& Luminance::current(){
+        const Luminance* tables = currentLuminance.load(std::memory_order_acquire);
+        if(tables == nullptr || tables->m_red != RED_BRIGHTNESS || tables->m_green != GREEN_BRIGHTNESS || tables->m_blue != BLUE_BRIGHTNESS){
+            static std::mutex mutex;
+            static std::vector<std::unique_ptr<Luminance>> built;
+            std::lock_guard<std::mutex> lock(mutex);
+            tables = currentLuminance.load(std::memory_order_acquire);
+            if(tables == nullptr || tables->m_red != RED_BRIGHTNESS || tables->m_green != GREEN_BRIGHTNESS || tables->m_blue != BLUE_BRIGHTNESS){
+                built.emplace_back(new Luminance(RED_BRIGHTNESS, GREEN_BRIGHTNESS, BLUE_BRIGHTNESS));
+                tables = built.back().get();
+                currentLuminance.store(tables, std::memory_order_release);
+            }
+        }
+        return *tables;
+    }
+
+    void Luminance::values(const RGB* colors, float* out, size_t n) const{
+        // Gather the sums first, so the square roots are computed in a
+        // separate loop that can be vectorized
+        for(size_t i = 0; i < n; i++){
+            out[i] = m_r[colors[i].r] + m_g[colors[i].g] + m_b[colors[i].b];
+        }
+        for(size_t i = 0; i < n; i++){
+            out[i] = std::sqrt(out[i]) / 255.0;
+        }
+    }
+
+    void Luminance::keys(const RGB* colors, uint32_t* out, size_t n) const{
+        for(size_t i = 0; i < n; i++){
+            out[i] = key(colors[i]);
+        }
+    }
+
     RGB toRGB(const HSV& hsv){
         RGB rgb;
         rgb.a = hsv.a;
@@ -95,6 +161,625 @@ namespace mipa{
         return hsv;
     }
 
+    namespace{
+        // 2^24 / d rounded up, so (n * RECIPROCALS[d]) >> 24 is n / d for
+        // any n below 2^16
+        struct Reciprocals{
+            uint64_t values[256];
+            Reciprocals(){
+                values[0] = 0;
+                for(uint64_t d = 1; d < 256; d++){
+                    values[d] = (1 << 24) / d + 1;
+                }
+            }
+            inline uint divide(uint n, uint d) const{
+                return (n * values[d]) >> 24;
+            }
+        };
+        const Reciprocals RECIPROCALS;
+    }
+
+    FixedHSV toFixedHSV(const RGB& rgb){
+        // Without branches, as colors of an image rarely follow a pattern.
+        // Grays get a hue and saturation of 0 as the reciprocal of 0 is 0.
+        FixedHSV hsv;
+        hsv.a = rgb.a;
+        int max = std::max(rgb.r, std::max(rgb.g, rgb.b));
+        int min = std::min(rgb.r, std::min(rgb.g, rgb.b));
+        int delta = max - min;
+        hsv.v = max;
+        hsv.s = RECIPROCALS.divide(255 * delta + max / 2, max);
+        // Index of the biggest channel, preferring red then green, and
+        // offset inside its sector, in [-256, 256] steps, rounded
+        static const uint8_t NEXT[3] = {1, 2, 0};
+        static const uint8_t PREVIOUS[3] = {2, 0, 1};
+        int channels[3] = {rgb.r, rgb.g, rgb.b};
+        int red = rgb.r == max;
+        int green = !red & (rgb.g == max);
+        int biggest = 2 - 2 * red - green;
+        int diff = channels[NEXT[biggest]] - channels[PREVIOUS[biggest]];
+        int sign = diff >> 31;
+        int offset = RECIPROCALS.divide(256 * ((diff ^ sign) - sign) + delta / 2, delta);
+        int hue = biggest * 512 + ((offset ^ sign) - sign);
+        hsv.h = hue + ((hue >> 31) & FIXED_HUES);
+        return hsv;
+    }
+
+    RGB toRGB(const FixedHSV& hsv){
+        // Which of v, p, q and t is each channel in each sector
+        static const uint8_t CHANNELS[6][3] = {{0, 3, 1}, {2, 0, 1}, {1, 0, 3}, {1, 2, 0}, {3, 1, 0}, {0, 1, 2}};
+        int v = hsv.v;
+        int s = hsv.s;
+        int f = hsv.h % 256;
+        // v, v * (1 - s), v * (1 - s * f) and v * (1 - s * (1 - f)), rounded
+        uint8_t values[4] = {
+            (uint8_t)v,
+            (uint8_t)((v * (255 - s) + 127) / 255),
+            (uint8_t)((v * (255 * 256 - s * f) + 255 * 128) / (255 * 256)),
+            (uint8_t)((v * (255 * 256 - s * (256 - f)) + 255 * 128) / (255 * 256))
+        };
+        const uint8_t* channels = CHANNELS[hsv.h / 256];
+        return RGB(values[channels[0]], values[channels[1]], values[channels[2]], hsv.a);
+    }
+
+    namespace{
+        const float INV255 = 1.f / 255;
+
+        // The row conversions work on each color with the same operations,
+        // selecting the result of each case instead of branching. The scalar
+        // versions are used for the last colors of a row and give the same
+        // results as the vector ones
+
+        inline void toHSVScalar(const RGB& color, float& h, float& s, float& v){
+            float r = color.r * INV255;
+            float g = color.g * INV255;
+            float b = color.b * INV255;
+            float max = std::max(r, std::max(g, b));
+            float min = std::min(r, std::min(g, b));
+            float delta = max - min;
+            float hue = 0, sat = 0;
+            if(delta > 0){
+                hue = r >= max ? (g - b) / delta : g >= max ? 2.f + (b - r) / delta : 4.f + (r - g) / delta;
+                hue = hue * 60.f;
+                if(hue < 0) hue += 360.f;
+                sat = delta / max;
+            }
+            h = hue;
+            s = sat;
+            v = max;
+        }
+
+        inline void toRGBScalar(float h, float s, float v, RGB& color){
+            s = std::min(1.f, std::max(0.f, s));
+            v = std::min(1.f, std::max(0.f, v));
+            float max = (int)(v * 255.f);
+            float hue = h - 360.f * std::floor(h / 360.f);
+            hue = hue / 60.f;
+            float sector = std::min(5.f, std::floor(hue));
+            float ff = hue - sector;
+            float p = max * (1.f - s);
+            float q = max * (1.f - s * ff);
+            float t = max * (1.f - s * (1.f - ff));
+            float r = sector == 0 || sector == 5 ? max : sector == 1 ? q : sector == 4 ? t : p;
+            float g = sector == 1 || sector == 2 ? max : sector == 0 ? t : sector == 3 ? q : p;
+            float b = sector == 3 || sector == 4 ? max : sector == 2 ? t : sector == 5 ? q : p;
+            color = RGB((int)r, (int)g, (int)b, color.a);
+        }
+
+        void toHSVRowScalar(const RGB* rgb, float* h, float* s, float* v, size_t n){
+            for(size_t i = 0; i < n; i++){
+                toHSVScalar(rgb[i], h[i], s[i], v[i]);
+            }
+        }
+
+        void toRGBRowScalar(const float* h, const float* s, const float* v, RGB* rgb, size_t n){
+            for(size_t i = 0; i < n; i++){
+                toRGBScalar(h[i], s[i], v[i], rgb[i]);
+            }
+        }
+
+        void toFixedHSVRowScalar(const RGB* rgb, uint16_t* h, uint8_t* s, uint8_t* v, size_t n){
+            for(size_t i = 0; i < n; i++){
+                FixedHSV hsv = toFixedHSV(rgb[i]);
+                h[i] = hsv.h;
+                s[i] = hsv.s;
+                v[i] = hsv.v;
+            }
+        }
+
+        void toRGBFixedRowScalar(const uint16_t* h, const uint8_t* s, const uint8_t* v, RGB* rgb, size_t n){
+            for(size_t i = 0; i < n; i++){
+                FixedHSV hsv;
+                hsv.h = h[i];
+                hsv.s = s[i];
+                hsv.v = v[i];
+                hsv.a = rgb[i].a;
+                rgb[i] = toRGB(hsv);
+            }
+        }
+
+        // Coefficients from linear sRGB to the cone responses, or to the
+        // tristimulus values relative to the white point, and from their
+        // nonlinear responses to the lab components
+        struct LabTransform{
+            float toCone[3][3];
+            float toLab[3][3];
+            float offset; ///< Added to the lightness
+            bool cie; ///< Linear response for dark colors
+            float slack; ///< Padding of the bounds
+        };
+
+        const LabTransform OKLAB_TRANSFORM = {
+            {
+                {0.4122214708f, 0.5363325363f, 0.0514459929f},
+                {0.2119034982f, 0.6806995451f, 0.1073969566f},
+                {0.0883024619f, 0.2817188376f, 0.6299787005f}
+            },
+            {
+                {0.2104542553f, 0.7936177850f, -0.0040720468f},
+                {1.9779984951f, -2.4285922050f, 0.4505937099f},
+                {0.0259040371f, 0.7827717662f, -0.8086757660f}
+            },
+            0.f, false, 1e-4f
+        };
+
+        // The rows of X and Z are divided by those of the D65 white point
+        const LabTransform CIELAB_TRANSFORM = {
+            {
+                {0.4124564f / 0.95047f, 0.3575761f / 0.95047f, 0.1804375f / 0.95047f},
+                {0.2126729f, 0.7151522f, 0.0721750f},
+                {0.0193339f / 1.08883f, 0.1191920f / 1.08883f, 0.9503041f / 1.08883f}
+            },
+            {
+                {0.f, 116.f, 0.f},
+                {500.f, -500.f, 0.f},
+                {0.f, 200.f, -200.f}
+            },
+            -16.f, true, 1e-2f
+        };
+
+        inline const LabTransform& labTransform(LabSpace space){
+            return space == CIELAB ? CIELAB_TRANSFORM : OKLAB_TRANSFORM;
+        }
+
+        // Relative value below which the response of CIE L*a*b* is linear
+        const float CIE_EPSILON = 216.f / 24389.f;
+        const float CIE_SLOPE = 24389.f / 27.f / 116.f;
+        const float CIE_INTERCEPT = 16.f / 116.f;
+        // Bits of the cube root of 1, minus a third of the bits of 1
+        const int32_t CUBE_ROOT_BIAS = 709921077;
+
+        struct LinearTable{
+            float values[256];
+            LinearTable(){
+                for(int v = 0; v < 256; v++){
+                    double c = v / 255.0;
+                    values[v] = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+                }
+            }
+        };
+
+        const LinearTable& linearTable(){
+            static const LinearTable table;
+            return table;
+        }
+
+        // Guess from the bits of the float, refined with two iterations of
+        // Halley's method. std::cbrt is much slower and has no vector version
+        inline float cubeRoot(float x){
+            if(!(x > 0)){
+                return 0;
+            }
+            int32_t bits;
+            std::memcpy(&bits, &x, sizeof(bits));
+            bits = (int32_t)((float)bits * (1.f / 3)) + CUBE_ROOT_BIAS;
+            float y;
+            std::memcpy(&y, &bits, sizeof(y));
+            for(int i = 0; i < 2; i++){
+                float y3 = y * y * y;
+                y = y * (y3 + (x + x)) / ((y3 + y3) + x);
+            }
+            return y;
+        }
+
+        inline float response(float cone, bool cie){
+            if(cie && !(cone > CIE_EPSILON)){
+                return cone * CIE_SLOPE + CIE_INTERCEPT;
+            }
+            return cubeRoot(cone);
+        }
+
+        inline void toLabScalar(const RGB& color, const LabTransform& t, float& l, float& a, float& b){
+            const float* linear = linearTable().values;
+            float r = linear[color.r];
+            float g = linear[color.g];
+            float bl = linear[color.b];
+            float f[3];
+            for(int k = 0; k < 3; k++){
+                f[k] = response(t.toCone[k][0] * r + t.toCone[k][1] * g + t.toCone[k][2] * bl, t.cie);
+            }
+            l = t.toLab[0][0] * f[0] + t.toLab[0][1] * f[1] + t.toLab[0][2] * f[2] + t.offset;
+            a = t.toLab[1][0] * f[0] + t.toLab[1][1] * f[1] + t.toLab[1][2] * f[2];
+            b = t.toLab[2][0] * f[0] + t.toLab[2][1] * f[1] + t.toLab[2][2] * f[2];
+        }
+
+        void toLabRowScalar(const RGB* rgb, float* l, float* a, float* b, size_t n, const LabTransform& t){
+            for(size_t i = 0; i < n; i++){
+                toLabScalar(rgb[i], t, l[i], a[i], b[i]);
+            }
+        }
+
+        // Response without approximations, to compute bounds
+        inline double exactResponse(double cone, bool cie){
+            if(cie && !(cone > CIE_EPSILON)){
+                return cone * (24389.0 / 27 / 116) + 16.0 / 116;
+            }
+            return std::cbrt(std::max(0.0, cone));
+        }
+
+#ifdef MIPA_X86_SIMD
+        __attribute__((target("sse2")))
+        inline __m128 select(__m128 mask, __m128 a, __m128 b){
+            return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+        }
+
+        __attribute__((target("sse2")))
+        inline __m128 floor(__m128 x){
+            __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+            return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.f)));
+        }
+
+        __attribute__((target("sse2")))
+        void toHSVRowSSE2(const RGB* rgb, float* h, float* s, float* v, size_t n){
+            const __m128i byte = _mm_set1_epi32(0xff);
+            const __m128 scale = _mm_set1_ps(INV255);
+            const __m128 zero = _mm_setzero_ps();
+            size_t i = 0;
+            for(; i + 4 <= n; i += 4){
+                __m128i pixels = _mm_loadu_si128((const __m128i*)(rgb + i));
+                __m128 r = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(pixels, byte)), scale);
+                __m128 g = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 8), byte)), scale);
+                __m128 b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 16), byte)), scale);
+                __m128 max = _mm_max_ps(r, _mm_max_ps(g, b));
+                __m128 min = _mm_min_ps(r, _mm_min_ps(g, b));
+                __m128 delta = _mm_sub_ps(max, min);
+                // Grays divide by zero, and are cleared at the end
+                __m128 colored = _mm_cmpgt_ps(delta, zero);
+                __m128 hueR = _mm_div_ps(_mm_sub_ps(g, b), delta);
+                __m128 hueG = _mm_add_ps(_mm_set1_ps(2.f), _mm_div_ps(_mm_sub_ps(b, r), delta));
+                __m128 hueB = _mm_add_ps(_mm_set1_ps(4.f), _mm_div_ps(_mm_sub_ps(r, g), delta));
+                __m128 hue = select(_mm_cmpge_ps(r, max), hueR, select(_mm_cmpge_ps(g, max), hueG, hueB));
+                hue = _mm_mul_ps(hue, _mm_set1_ps(60.f));
+                hue = _mm_add_ps(hue, _mm_and_ps(_mm_cmplt_ps(hue, zero), _mm_set1_ps(360.f)));
+                _mm_storeu_ps(h + i, _mm_and_ps(colored, hue));
+                _mm_storeu_ps(s + i, _mm_and_ps(colored, _mm_div_ps(delta, max)));
+                _mm_storeu_ps(v + i, max);
+            }
+            toHSVRowScalar(rgb + i, h + i, s + i, v + i, n - i);
+        }
+
+        __attribute__((target("sse2")))
+        void toRGBRowSSE2(const float* h, const float* s, const float* v, RGB* rgb, size_t n){
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one = _mm_set1_ps(1.f);
+            size_t i = 0;
+            for(; i + 4 <= n; i += 4){
+                __m128 sat = _mm_min_ps(one, _mm_max_ps(zero, _mm_loadu_ps(s + i)));
+                __m128 val = _mm_min_ps(one, _mm_max_ps(zero, _mm_loadu_ps(v + i)));
+                __m128 max = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(val, _mm_set1_ps(255.f))));
+                __m128 hue = _mm_loadu_ps(h + i);
+                hue = _mm_sub_ps(hue, _mm_mul_ps(_mm_set1_ps(360.f), floor(_mm_div_ps(hue, _mm_set1_ps(360.f)))));
+                hue = _mm_div_ps(hue, _mm_set1_ps(60.f));
+                __m128 sector = _mm_min_ps(_mm_set1_ps(5.f), floor(hue));
+                __m128 ff = _mm_sub_ps(hue, sector);
+                __m128 p = _mm_mul_ps(max, _mm_sub_ps(one, sat));
+                __m128 q = _mm_mul_ps(max, _mm_sub_ps(one, _mm_mul_ps(sat, ff)));
+                __m128 t = _mm_mul_ps(max, _mm_sub_ps(one, _mm_mul_ps(sat, _mm_sub_ps(one, ff))));
+                __m128 is0 = _mm_cmpeq_ps(sector, zero);
+                __m128 is1 = _mm_cmpeq_ps(sector, one);
+                __m128 is2 = _mm_cmpeq_ps(sector, _mm_set1_ps(2.f));
+                __m128 is3 = _mm_cmpeq_ps(sector, _mm_set1_ps(3.f));
+                __m128 is4 = _mm_cmpeq_ps(sector, _mm_set1_ps(4.f));
+                __m128 is5 = _mm_cmpeq_ps(sector, _mm_set1_ps(5.f));
+                __m128 r = select(_mm_or_ps(is0, is5), max, select(is1, q, select(is4, t, p)));
+                __m128 g = select(_mm_or_ps(is1, is2), max, select(is0, t, select(is3, q, p)));
+                __m128 b = select(_mm_or_ps(is3, is4), max, select(is2, t, select(is5, q, p)));
+                __m128i* out = (__m128i*)(rgb + i);
+                __m128i alpha = _mm_and_si128(_mm_loadu_si128(out), _mm_set1_epi32(0xff000000));
+                __m128i pixels = _mm_or_si128(
+                    _mm_or_si128(_mm_cvttps_epi32(r), _mm_slli_epi32(_mm_cvttps_epi32(g), 8)),
+                    _mm_or_si128(_mm_slli_epi32(_mm_cvttps_epi32(b), 16), alpha)
+                );
+                _mm_storeu_si128(out, pixels);
+            }
+            toRGBRowScalar(h + i, s + i, v + i, rgb + i, n - i);
+        }
+
+        // The fixed point kernels work on 32 bit lanes holding values below
+        // 2^16, where the 16 bit instructions of SSE2 give exact results.
+        // Quotients of numbers below 2^16 by numbers below 256 are exact in
+        // single precision, as the rounding error is below 1 / 256.
+
+        __attribute__((target("sse2")))
+        inline __m128i multiply16(__m128i a, __m128i b){
+            return _mm_or_si128(_mm_mullo_epi16(a, b), _mm_slli_epi32(_mm_mulhi_epu16(a, b), 16));
+        }
+
+        // x / 255 for x below 65535
+        __attribute__((target("sse2")))
+        inline __m128i divide255(__m128i x){
+            return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, _mm_set1_epi32(1)), _mm_srli_epi32(x, 8)), 8);
+        }
+
+        __attribute__((target("sse2")))
+        inline __m128i divide(__m128i n, __m128i d){
+            return _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(n), _mm_cvtepi32_ps(d)));
+        }
+
+        __attribute__((target("sse2")))
+        void toFixedHSVSSE2(__m128i pixels, __m128i& h, __m128i& s, __m128i& v){
+            const __m128i byte = _mm_set1_epi32(0xff);
+            const __m128i one = _mm_set1_epi32(1);
+            __m128i r = _mm_and_si128(pixels, byte);
+            __m128i g = _mm_and_si128(_mm_srli_epi32(pixels, 8), byte);
+            __m128i b = _mm_and_si128(_mm_srli_epi32(pixels, 16), byte);
+            __m128i max = _mm_max_epi16(r, _mm_max_epi16(g, b));
+            __m128i min = _mm_min_epi16(r, _mm_min_epi16(g, b));
+            __m128i delta = _mm_sub_epi32(max, min);
+            __m128i scaled = _mm_sub_epi32(_mm_slli_epi32(delta, 8), delta);
+            s = divide(_mm_add_epi32(scaled, _mm_srli_epi32(max, 1)), _mm_max_epi16(max, one));
+            v = max;
+            __m128i red = _mm_cmpeq_epi32(r, max);
+            __m128i green = _mm_andnot_si128(red, _mm_cmpeq_epi32(g, max));
+            __m128i blue = _mm_andnot_si128(_mm_or_si128(red, green), _mm_set1_epi32(-1));
+            __m128i diff = _mm_or_si128(
+                _mm_and_si128(red, _mm_sub_epi32(g, b)),
+                _mm_or_si128(_mm_and_si128(green, _mm_sub_epi32(b, r)), _mm_and_si128(blue, _mm_sub_epi32(r, g)))
+            );
+            __m128i sign = _mm_srai_epi32(diff, 31);
+            __m128i size = _mm_sub_epi32(_mm_xor_si128(diff, sign), sign);
+            __m128i offset = divide(_mm_add_epi32(_mm_slli_epi32(size, 8), _mm_srli_epi32(delta, 1)), _mm_max_epi16(delta, one));
+            __m128i sector = _mm_or_si128(_mm_and_si128(green, _mm_set1_epi32(512)), _mm_and_si128(blue, _mm_set1_epi32(1024)));
+            __m128i hue = _mm_add_epi32(sector, _mm_sub_epi32(_mm_xor_si128(offset, sign), sign));
+            h = _mm_add_epi32(hue, _mm_and_si128(_mm_srai_epi32(hue, 31), _mm_set1_epi32(FIXED_HUES)));
+        }
+
+        __attribute__((target("sse2")))
+        void toFixedHSVRowSSE2(const RGB* rgb, uint16_t* h, uint8_t* s, uint8_t* v, size_t n){
+            size_t i = 0;
+            for(; i + 8 <= n; i += 8){
+                __m128i h0, s0, v0, h1, s1, v1;
+                toFixedHSVSSE2(_mm_loadu_si128((const __m128i*)(rgb + i)), h0, s0, v0);
+                toFixedHSVSSE2(_mm_loadu_si128((const __m128i*)(rgb + i + 4)), h1, s1, v1);
+                __m128i sat = _mm_packs_epi32(s0, s1);
+                __m128i val = _mm_packs_epi32(v0, v1);
+                _mm_storeu_si128((__m128i*)(h + i), _mm_packs_epi32(h0, h1));
+                _mm_storel_epi64((__m128i*)(s + i), _mm_packus_epi16(sat, sat));
+                _mm_storel_epi64((__m128i*)(v + i), _mm_packus_epi16(val, val));
+            }
+            toFixedHSVRowScalar(rgb + i, h + i, s + i, v + i, n - i);
+        }
+
+        __attribute__((target("sse2")))
+        __m128i toRGBFixedSSE2(__m128i h, __m128i s, __m128i v){
+            const __m128i full = _mm_set1_epi32(255 * 256);
+            const __m128i half = _mm_set1_epi32(255 * 128);
+            __m128i sector = _mm_srli_epi32(h, 8);
+            __m128i f = _mm_and_si128(h, _mm_set1_epi32(0xff));
+            __m128i p = divide255(_mm_add_epi32(multiply16(v, _mm_sub_epi32(_mm_set1_epi32(255), s)), _mm_set1_epi32(127)));
+            __m128i q = _mm_add_epi32(multiply16(v, _mm_sub_epi32(full, _mm_mullo_epi16(s, f))), half);
+            __m128i t = _mm_add_epi32(multiply16(v, _mm_sub_epi32(full, _mm_mullo_epi16(s, _mm_sub_epi32(_mm_set1_epi32(256), f)))), half);
+            q = divide255(_mm_srli_epi32(q, 8));
+            t = divide255(_mm_srli_epi32(t, 8));
+            __m128i is0 = _mm_cmpeq_epi32(sector, _mm_setzero_si128());
+            __m128i is1 = _mm_cmpeq_epi32(sector, _mm_set1_epi32(1));
+            __m128i is2 = _mm_cmpeq_epi32(sector, _mm_set1_epi32(2));
+            __m128i is3 = _mm_cmpeq_epi32(sector, _mm_set1_epi32(3));
+            __m128i is4 = _mm_cmpeq_epi32(sector, _mm_set1_epi32(4));
+            __m128i is5 = _mm_cmpeq_epi32(sector, _mm_set1_epi32(5));
+            __m128i r = _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(_mm_or_si128(is0, is5), v), _mm_and_si128(is1, q)),
+                _mm_or_si128(_mm_and_si128(_mm_or_si128(is2, is3), p), _mm_and_si128(is4, t))
+            );
+            __m128i g = _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(_mm_or_si128(is1, is2), v), _mm_and_si128(is0, t)),
+                _mm_or_si128(_mm_and_si128(_mm_or_si128(is4, is5), p), _mm_and_si128(is3, q))
+            );
+            __m128i b = _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(_mm_or_si128(is3, is4), v), _mm_and_si128(is2, t)),
+                _mm_or_si128(_mm_and_si128(_mm_or_si128(is0, is1), p), _mm_and_si128(is5, q))
+            );
+            return _mm_or_si128(r, _mm_or_si128(_mm_slli_epi32(g, 8), _mm_slli_epi32(b, 16)));
+        }
+
+        __attribute__((target("sse2")))
+        void toRGBFixedRowSSE2(const uint16_t* h, const uint8_t* s, const uint8_t* v, RGB* rgb, size_t n){
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i alpha = _mm_set1_epi32(0xff000000);
+            size_t i = 0;
+            for(; i + 8 <= n; i += 8){
+                __m128i hue = _mm_loadu_si128((const __m128i*)(h + i));
+                __m128i sat = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s + i)), zero);
+                __m128i val = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(v + i)), zero);
+                __m128i* out = (__m128i*)(rgb + i);
+                __m128i first = toRGBFixedSSE2(_mm_unpacklo_epi16(hue, zero), _mm_unpacklo_epi16(sat, zero), _mm_unpacklo_epi16(val, zero));
+                __m128i second = toRGBFixedSSE2(_mm_unpackhi_epi16(hue, zero), _mm_unpackhi_epi16(sat, zero), _mm_unpackhi_epi16(val, zero));
+                _mm_storeu_si128(out, _mm_or_si128(first, _mm_and_si128(_mm_loadu_si128(out), alpha)));
+                _mm_storeu_si128(out + 1, _mm_or_si128(second, _mm_and_si128(_mm_loadu_si128(out + 1), alpha)));
+            }
+            toRGBFixedRowScalar(h + i, s + i, v + i, rgb + i, n - i);
+        }
+
+        __attribute__((target("sse2")))
+        inline __m128 cubeRoot(__m128 x){
+            __m128i bits = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_castps_si128(x)), _mm_set1_ps(1.f / 3)));
+            __m128 y = _mm_castsi128_ps(_mm_add_epi32(bits, _mm_set1_epi32(CUBE_ROOT_BIAS)));
+            for(int i = 0; i < 2; i++){
+                __m128 y3 = _mm_mul_ps(_mm_mul_ps(y, y), y);
+                y = _mm_div_ps(_mm_mul_ps(y, _mm_add_ps(y3, _mm_add_ps(x, x))), _mm_add_ps(_mm_add_ps(y3, y3), x));
+            }
+            return _mm_and_ps(_mm_cmpgt_ps(x, _mm_setzero_ps()), y);
+        }
+
+        __attribute__((target("sse2")))
+        inline __m128 response(__m128 cone, bool cie){
+            __m128 root = cubeRoot(cone);
+            if(!cie){
+                return root;
+            }
+            __m128 linear = _mm_add_ps(_mm_mul_ps(cone, _mm_set1_ps(CIE_SLOPE)), _mm_set1_ps(CIE_INTERCEPT));
+            return select(_mm_cmpgt_ps(cone, _mm_set1_ps(CIE_EPSILON)), root, linear);
+        }
+
+        __attribute__((target("sse2")))
+        inline __m128 product(const float m[3], __m128 x, __m128 y, __m128 z){
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0]), x), _mm_mul_ps(_mm_set1_ps(m[1]), y)), _mm_mul_ps(_mm_set1_ps(m[2]), z));
+        }
+
+        __attribute__((target("sse2")))
+        void toLabRowSSE2(const RGB* rgb, float* l, float* a, float* b, size_t n, const LabTransform& t){
+            // SSE2 has no gather, the table is read for each channel
+            const float* linear = linearTable().values;
+            size_t i = 0;
+            for(; i + 4 <= n; i += 4){
+                const RGB* c = rgb + i;
+                __m128 r = _mm_setr_ps(linear[c[0].r], linear[c[1].r], linear[c[2].r], linear[c[3].r]);
+                __m128 g = _mm_setr_ps(linear[c[0].g], linear[c[1].g], linear[c[2].g], linear[c[3].g]);
+                __m128 bl = _mm_setr_ps(linear[c[0].b], linear[c[1].b], linear[c[2].b], linear[c[3].b]);
+                __m128 f0 = response(product(t.toCone[0], r, g, bl), t.cie);
+                __m128 f1 = response(product(t.toCone[1], r, g, bl), t.cie);
+                __m128 f2 = response(product(t.toCone[2], r, g, bl), t.cie);
+                _mm_storeu_ps(l + i, _mm_add_ps(product(t.toLab[0], f0, f1, f2), _mm_set1_ps(t.offset)));
+                _mm_storeu_ps(a + i, product(t.toLab[1], f0, f1, f2));
+                _mm_storeu_ps(b + i, product(t.toLab[2], f0, f1, f2));
+            }
+            toLabRowScalar(rgb + i, l + i, a + i, b + i, n - i, t);
+        }
+#endif
+
+        // Row conversions, chosen once for the host
+        struct RowKernels{
+            void (*toHSV)(const RGB* rgb, float* h, float* s, float* v, size_t n);
+            void (*toRGB)(const float* h, const float* s, const float* v, RGB* rgb, size_t n);
+            void (*toFixedHSV)(const RGB* rgb, uint16_t* h, uint8_t* s, uint8_t* v, size_t n);
+            void (*toRGBFixed)(const uint16_t* h, const uint8_t* s, const uint8_t* v, RGB* rgb, size_t n);
+            void (*toLab)(const RGB* rgb, float* l, float* a, float* b, size_t n, const LabTransform& t);
+        };
+
+        RowKernels selectRowKernels(){
+#ifdef MIPA_X86_SIMD
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("sse2")) return {toHSVRowSSE2, toRGBRowSSE2, toFixedHSVRowSSE2, toRGBFixedRowSSE2, toLabRowSSE2};
+#endif
+            return {toHSVRowScalar, toRGBRowScalar, toFixedHSVRowScalar, toRGBFixedRowScalar, toLabRowScalar};
+        }
+
+        const RowKernels& rowKernels(){
+            static const RowKernels kernels = selectRowKernels();
+            return kernels;
+        }
+    }
+
+    void toHSV(const RGB* rgb, float* h, float* s, float* v, size_t n){
+        rowKernels().toHSV(rgb, h, s, v, n);
+    }
+
+    void toRGB(const float* h, const float* s, const float* v, RGB* rgb, size_t n){
+        rowKernels().toRGB(h, s, v, rgb, n);
+    }
+
+    void toFixedHSV(const RGB* rgb, uint16_t* h, uint8_t* s, uint8_t* v, size_t n){
+        rowKernels().toFixedHSV(rgb, h, s, v, n);
+    }
+
+    void toRGB(const uint16_t* h, const uint8_t* s, const uint8_t* v, RGB* rgb, size_t n){
+        rowKernels().toRGBFixed(h, s, v, rgb, n);
+    }
+
+    float toLinear(uint8_t value){
+        return linearTable().values[value];
+    }
+
+    Lab toLab(const RGB& rgb, LabSpace space){
+        Lab lab;
+        toLabScalar(rgb, labTransform(space), lab.l, lab.a, lab.b);
+        return lab;
+    }
+
+    void toLab(const RGB* rgb, float* l, float* a, float* b, size_t n, LabSpace space){
+        rowKernels().toLab(rgb, l, a, b, n, labTransform(space));
+    }
+
+    void labBounds(const RGB& lo, const RGB& hi, LabSpace space, Lab& min, Lab& max){
+        // Each response is concave, so over the range of its cone it is
+        // between its chord and the chord plus a gap. That makes the lab
+        // components an affine function of the linear channels, whose range
+        // over a box is exact, plus a small error. Bounding each step alone
+        // would be much looser, as the cones are strongly correlated
+        const LabTransform& t = labTransform(space);
+        double linearLo[3] = {toLinear(lo.r), toLinear(lo.g), toLinear(lo.b)};
+        double linearHi[3] = {toLinear(hi.r), toLinear(hi.g), toLinear(hi.b)};
+        double slope[3], intercept[3], gap[3];
+        for(int k = 0; k < 3; k++){
+            double coneLo = 0, coneHi = 0;
+            for(int j = 0; j < 3; j++){
+                coneLo += t.toCone[k][j] * (t.toCone[k][j] < 0 ? linearHi[j] : linearLo[j]);
+                coneHi += t.toCone[k][j] * (t.toCone[k][j] < 0 ? linearLo[j] : linearHi[j]);
+            }
+            double responseLo = exactResponse(coneLo, t.cie);
+            double responseHi = exactResponse(coneHi, t.cie);
+            slope[k] = coneHi > coneLo ? (responseHi - responseLo) / (coneHi - coneLo) : 0;
+            intercept[k] = responseLo - slope[k] * coneLo;
+            // The response is furthest from the chord where its slope is
+            // the same as the one of the chord
+            double tangent = slope[k] > 0 ? std::pow(3 * slope[k], -1.5) : coneLo;
+            tangent = std::max(coneLo, std::min(coneHi, tangent));
+            gap[k] = std::max(0.0, exactResponse(tangent, t.cie) - (intercept[k] + slope[k] * tangent));
+        }
+        double bounds[3][2];
+        for(int c = 0; c < 3; c++){
+            double low = c == 0 ? t.offset : 0;
+            double high = low;
+            for(int k = 0; k < 3; k++){
+                double weight = t.toLab[c][k];
+                low += weight * intercept[k] + std::min(0.0, weight * gap[k]);
+                high += weight * intercept[k] + std::max(0.0, weight * gap[k]);
+            }
+            for(int j = 0; j < 3; j++){
+                double weight = 0;
+                for(int k = 0; k < 3; k++){
+                    weight += t.toLab[c][k] * slope[k] * t.toCone[k][j];
+                }
+                low += weight * (weight < 0 ? linearHi[j] : linearLo[j]);
+                high += weight * (weight < 0 ? linearLo[j] : linearHi[j]);
+            }
+            bounds[c][0] = low - t.slack;
+            bounds[c][1] = high + t.slack;
+        }
+        min.l = bounds[0][0];
+        min.a = bounds[1][0];
+        min.b = bounds[2][0];
+        max.l = bounds[0][1];
+        max.a = bounds[1][1];
+        max.b = bounds[2][1];
+    }
+
+    void shiftHue(const RGB* in, RGB* out, size_t n, float angle){
+        const size_t BATCH = 256;
+        float h[BATCH], s[BATCH], v[BATCH];
+        for(size_t i = 0; i < n; i += BATCH){
+            size_t count = std::min(BATCH, n - i);
+            toHSV(in + i, h, s, v, count);
+            for(size_t k = 0; k < count; k++){
+                h[k] += angle;
+            }
+            if(out != in){
+                std::copy(in + i, in + i + count, out + i);
+            }
+            toRGB(h, s, v, out + i, count);
+        }
+    }
+
     RGB shiftHue(const RGB& color, float angle){
         HSV hsv = toHSV(color);
         double hue = hsv.h;
@@ -118,19 +803,11 @@ namespace mipa{
         );
     }
     RGB grayScale(const RGB& color){
-        int gray = std::sqrt(
-            color.r * color.r * RED_BRIGHTNESS +
-            color.g * color.g * GREEN_BRIGHTNESS +
-            color.b * color.b * BLUE_BRIGHTNESS
-        );
+        int gray = Luminance::current().brightness(color);
         return RGB(gray, gray, gray);
     }
     float grayValue(const RGB& color){
-        return std::sqrt(
-            color.r * color.r * RED_BRIGHTNESS +
-            color.g * color.g * GREEN_BRIGHTNESS +
-            color.b * color.b * BLUE_BRIGHTNESS
-        ) / 255.0; 
+        return Luminance::current().value(color);
     }
 
     float rgbDistance(const RGB& a, const RGB& b){
@@ -145,6 +822,12 @@ namespace mipa{
     float grayDistance(const RGB& a, const RGB& b){
         return std::abs(grayValue(a) - grayValue(b));
     }
+    float labSquaredDistance(const Lab& a, const Lab& b){
+        float dl = a.l - b.l;
+        float da = a.a - b.a;
+        float db = a.b - b.b;
+        return dl * dl + da * da + db * db;
+    }
 
     RGB lerp(const RGB& from, const RGB& to, float t){
         return RGB(
@@ -0,0 +1,80 @@
+#include "IntegralImage.hpp"
+
+#include <algorithm>
+
+namespace mipa{
+    IntegralImage::IntegralImage():
+        m_width(0),
+        m_height(0){}
+
+    IntegralImage::IntegralImage(ConstImageView image, ThreadPool* pool){
+        build(image, pool);
+    }
+
+    void IntegralImage::build(ConstImageView image, ThreadPool* pool){
+        m_width = image.width;
+        m_height = image.height;
+        size_t stride = ((size_t)m_width + 1) * 4;
+        m_sums.resize(stride * (m_height + 1));
+        std::fill(m_sums.begin(), m_sums.begin() + stride, 0);
+        uint bands = pool == nullptr ? 1 : std::min(pool->size(), m_height);
+        if(bands <= 1){
+            sumRows(image, 0, m_height);
+            return;
+        }
+        auto begin = [&](uint band) -> uint {
+            return (unsigned long)m_height * band / bands;
+        };
+        pool->run([&](uint index){
+            if(index < bands){
+                sumRows(image, begin(index), begin(index + 1));
+            }
+        });
+        // The first band is already right. The offset of each other band is
+        // the offset of the previous one plus its last row
+        m_offsets.resize(stride * bands);
+        std::fill(m_offsets.begin(), m_offsets.begin() + stride, 0);
+        for(uint band = 1; band < bands; band++){
+            const uint64_t* previous = &m_offsets[(band - 1) * stride];
+            const uint64_t* last = &m_sums[begin(band) * stride];
+            uint64_t* offset = &m_offsets[band * stride];
+            for(size_t i = 0; i < stride; i++){
+                offset[i] = previous[i] + last[i];
+            }
+        }
+        pool->run([&](uint index){
+            if(index == 0 || index >= bands) return;
+            const uint64_t* offset = &m_offsets[index * stride];
+            for(uint y = begin(index) + 1; y <= begin(index + 1); y++){
+                uint64_t* sums = &m_sums[y * stride];
+                for(size_t i = 0; i < stride; i++){
+                    sums[i] += offset[i];
+                }
+            }
+        });
+    }
+
+    void IntegralImage::sumRows(ConstImageView image, uint begin, uint end){
+        size_t stride = ((size_t)m_width + 1) * 4;
+        for(uint y = begin; y < end; y++){
+            const RGB* row = image.row(y);
+            // The first row of a band starts from the zeros of the top row
+            const uint64_t* above = &m_sums[(y == begin ? 0 : y) * stride];
+            uint64_t* sums = &m_sums[(y + 1) * stride];
+            uint64_t r = 0, g = 0, b = 0, a = 0;
+            sums[0] = sums[1] = sums[2] = sums[3] = 0;
+            for(uint x = 0; x < m_width; x++){
+                r += row[x].r;
+                g += row[x].g;
+                b += row[x].b;
+                a += row[x].a;
+                uint64_t* out = sums + (x + 1) * 4;
+                const uint64_t* in = above + (x + 1) * 4;
+                out[0] = in[0] + r;
+                out[1] = in[1] + g;
+                out[2] = in[2] + b;
+                out[3] = in[3] + a;
+            }
+        }
+    }
+}
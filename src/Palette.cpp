@@ -6,10 +6,19 @@
 
 namespace mipa{
     Palette graySorted(Palette palette){
-        std::sort(palette.begin(), palette.end(), [](RGB a, RGB b) -> bool {
-            return grayValue(a) < grayValue(b);
-        });
-        return palette;
+        // Compute each key once instead of inside the comparator
+        const Luminance& luminance = Luminance::current();
+        std::vector<std::pair<uint32_t, uint>> keyed(palette.size());
+        for(uint i = 0; i < palette.size(); i++){
+            keyed[i] = std::make_pair(luminance.key(palette[i]), i);
+        }
+        std::sort(keyed.begin(), keyed.end());
+        Palette sorted;
+        sorted.reserve(palette.size());
+        for(const auto& entry: keyed){
+            sorted.push_back(palette[entry.second]);
+        }
+        return sorted;
     }
     Palette gradient(Palette from, const Palette& to, int steps){
         if(from.size() == 0) return to;
@@ -61,11 +70,19 @@ namespace mipa{
         return palette;
     }
     Palette closestByBrightness(Palette palette, const RGB& color){
-        std::sort(palette.begin(), palette.end(), [color](const RGB& a, const RGB& b) -> bool {
-            auto c = color;            
-            auto key = grayValue(c);
-            return std::abs(key - grayValue(a)) < std::abs(key - grayValue(b));
-        });
-        return palette;
+        // Compute each gray value once instead of inside the comparator
+        const Luminance& luminance = Luminance::current();
+        float key = luminance.value(color);
+        std::vector<std::pair<float, uint>> keyed(palette.size());
+        for(uint i = 0; i < palette.size(); i++){
+            keyed[i] = std::make_pair(std::abs(key - luminance.value(palette[i])), i);
+        }
+        std::sort(keyed.begin(), keyed.end());
+        Palette sorted;
+        sorted.reserve(palette.size());
+        for(const auto& entry: keyed){
+            sorted.push_back(palette[entry.second]);
+        }
+        return sorted;
     }
 }
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include "PaletteIndex.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace mipa{
+    // Search state. The found nodes are kept sorted, closest first, in the
+    // caller's buffer as positions of m_nodes until the search ends
+    struct PaletteIndex::Query{
+        float key[3];
+        uint k;
+        uint* found;
+        uint count;
+        float worst;
+    };
+
+    namespace{
+        inline float squaredDistance(const float* a, const float* b, int dims){
+            float d = 0;
+            for(int i = 0; i < dims; i++){
+                d += (a[i] - b[i]) * (a[i] - b[i]);
+            }
+            return d;
+        }
+    }
+
+    PaletteIndex::PaletteIndex(const Palette& palette, ColorMetric metric):
+        m_palette(palette),
+        m_metric(metric),
+        m_dims(metric == GRAY_DISTANCE ? 1 : 3),
+        m_luminance(&Luminance::current()),
+        m_nodes(palette.size())
+    {
+        if(palette.empty()){
+            throw std::runtime_error("PaletteIndex: empty palette");
+        }
+        for(uint i = 0; i < palette.size(); i++){
+            key(palette[i], m_nodes[i].key);
+            m_nodes[i].index = i;
+        }
+        build(0, m_nodes.size());
+    }
+
+    void PaletteIndex::key(const RGB& color, float* out) const{
+        if(m_metric == GRAY_DISTANCE){
+            out[0] = m_luminance->value(color);
+            out[1] = out[2] = 0;
+        }else{
+            out[0] = color.r;
+            out[1] = color.g;
+            out[2] = color.b;
+        }
+    }
+
+    void PaletteIndex::build(uint lo, uint hi){
+        if(hi - lo == 0) return;
+        // Split by the axis with the widest spread
+        int axis = 0;
+        float spread = -1;
+        for(int a = 0; a < m_dims; a++){
+            float min = std::numeric_limits<float>::max();
+            float max = std::numeric_limits<float>::lowest();
+            for(uint i = lo; i < hi; i++){
+                min = std::min(min, m_nodes[i].key[a]);
+                max = std::max(max, m_nodes[i].key[a]);
+            }
+            if(max - min > spread){
+                spread = max - min;
+                axis = a;
+            }
+        }
+        uint mid = lo + (hi - lo) / 2;
+        std::nth_element(
+            m_nodes.begin() + lo, m_nodes.begin() + mid, m_nodes.begin() + hi,
+            [axis](const Node& a, const Node& b) -> bool {
+                return a.key[axis] < b.key[axis];
+            }
+        );
+        m_nodes[mid].axis = axis;
+        build(lo, mid);
+        build(mid + 1, hi);
+    }
+
+    void PaletteIndex::search(uint lo, uint hi, Query& query) const{
+        if(hi - lo == 0) return;
+        uint mid = lo + (hi - lo) / 2;
+        const Node& node = m_nodes[mid];
+        float dist = squaredDistance(query.key, node.key, m_dims);
+        // Keep the closest colors, with ties sorted by palette order
+        auto closer = [&](float d, uint pos, uint other) -> bool {
+            float od = squaredDistance(query.key, m_nodes[other].key, m_dims);
+            return d < od || (d == od && m_nodes[pos].index < m_nodes[other].index);
+        };
+        if(query.count < query.k || closer(dist, mid, query.found[query.count - 1])){
+            uint j = std::min(query.count, query.k - 1);
+            while(j > 0 && closer(dist, mid, query.found[j - 1])){
+                query.found[j] = query.found[j - 1];
+                j--;
+            }
+            query.found[j] = mid;
+            query.count = std::min(query.count + 1, query.k);
+            if(query.count == query.k){
+                query.worst = squaredDistance(query.key, m_nodes[query.found[query.count - 1]].key, m_dims);
+            }
+        }
+        float diff = query.key[node.axis] - node.key[node.axis];
+        if(diff < 0){
+            search(lo, mid, query);
+            if(diff * diff <= query.worst) search(mid + 1, hi, query);
+        }else{
+            search(mid + 1, hi, query);
+            if(diff * diff <= query.worst) search(lo, mid, query);
+        }
+    }
+
+    const RGB& PaletteIndex::closest(const RGB& color) const{
+        uint index;
+        closest(color, 1, &index);
+        return m_palette[index];
+    }
+
+    uint PaletteIndex::closest(const RGB& color, uint k, uint* indices) const{
+        Query query;
+        key(color, query.key);
+        query.k = std::min<uint>(k, m_nodes.size());
+        query.found = indices;
+        query.count = 0;
+        query.worst = std::numeric_limits<float>::max();
+        if(query.k == 0) return 0;
+        search(0, m_nodes.size(), query);
+        for(uint i = 0; i < query.count; i++){
+            indices[i] = m_nodes[indices[i]].index;
+        }
+        return query.count;
+    }
+}
@@ -0,0 +1,191 @@
+#include "PaletteScan.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MIPA_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace mipa{
+    namespace{
+        const uint LANES = 16;
+        // Far enough so padding entries never win, small enough to not
+        // overflow the squared distance
+        const float UNREACHABLE = 1e6f;
+
+        uint scanScalar(const float* r, const float* g, const float* b, uint n, float qr, float qg, float qb){
+            uint best = 0;
+            float bestDist = UNREACHABLE * UNREACHABLE;
+            for(uint i = 0; i < n; i++){
+                float dr = r[i] - qr;
+                float dg = g[i] - qg;
+                float db = b[i] - qb;
+                float dist = dr * dr + dg * dg + db * db;
+                if(dist < bestDist){
+                    best = i;
+                    bestDist = dist;
+                }
+            }
+            return best;
+        }
+
+#ifdef MIPA_X86_SIMD
+        // Reduce the best distance and index of each lane, with ties
+        // resolved to the lowest index
+        inline uint horizontalArgmin(const float* dist, const int* index, uint lanes){
+            uint best = 0;
+            for(uint i = 1; i < lanes; i++){
+                if(dist[i] < dist[best] || (dist[i] == dist[best] && index[i] < index[best])){
+                    best = i;
+                }
+            }
+            return index[best];
+        }
+
+        __attribute__((target("sse2")))
+        uint scanSSE2(const float* r, const float* g, const float* b, uint n, float qr, float qg, float qb){
+            const __m128 vr = _mm_set1_ps(qr);
+            const __m128 vg = _mm_set1_ps(qg);
+            const __m128 vb = _mm_set1_ps(qb);
+            const __m128i step = _mm_set1_epi32(4);
+            __m128 bestDist = _mm_set1_ps(UNREACHABLE * UNREACHABLE);
+            __m128i bestIndex = _mm_setzero_si128();
+            __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+            for(uint i = 0; i < n; i += 4){
+                __m128 dr = _mm_sub_ps(_mm_loadu_ps(r + i), vr);
+                __m128 dg = _mm_sub_ps(_mm_loadu_ps(g + i), vg);
+                __m128 db = _mm_sub_ps(_mm_loadu_ps(b + i), vb);
+                __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+                __m128i closer = _mm_castps_si128(_mm_cmplt_ps(dist, bestDist));
+                bestDist = _mm_min_ps(dist, bestDist);
+                bestIndex = _mm_or_si128(_mm_and_si128(closer, index), _mm_andnot_si128(closer, bestIndex));
+                index = _mm_add_epi32(index, step);
+            }
+            float dists[4];
+            int indices[4];
+            _mm_storeu_ps(dists, bestDist);
+            _mm_storeu_si128((__m128i*)indices, bestIndex);
+            return horizontalArgmin(dists, indices, 4);
+        }
+
+        __attribute__((target("avx2")))
+        uint scanAVX2(const float* r, const float* g, const float* b, uint n, float qr, float qg, float qb){
+            const __m256 vr = _mm256_set1_ps(qr);
+            const __m256 vg = _mm256_set1_ps(qg);
+            const __m256 vb = _mm256_set1_ps(qb);
+            const __m256i step = _mm256_set1_epi32(8);
+            __m256 bestDist = _mm256_set1_ps(UNREACHABLE * UNREACHABLE);
+            __m256i bestIndex = _mm256_setzero_si256();
+            __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            for(uint i = 0; i < n; i += 8){
+                __m256 dr = _mm256_sub_ps(_mm256_loadu_ps(r + i), vr);
+                __m256 dg = _mm256_sub_ps(_mm256_loadu_ps(g + i), vg);
+                __m256 db = _mm256_sub_ps(_mm256_loadu_ps(b + i), vb);
+                __m256 dist = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+                __m256 closer = _mm256_cmp_ps(dist, bestDist, _CMP_LT_OQ);
+                bestDist = _mm256_min_ps(dist, bestDist);
+                bestIndex = _mm256_castps_si256(_mm256_blendv_ps(
+                    _mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), closer
+                ));
+                index = _mm256_add_epi32(index, step);
+            }
+            float dists[8];
+            int indices[8];
+            _mm256_storeu_ps(dists, bestDist);
+            _mm256_storeu_si256((__m256i*)indices, bestIndex);
+            return horizontalArgmin(dists, indices, 8);
+        }
+#endif
+
+        PaletteScan::Kernel selectKernel(){
+#ifdef MIPA_X86_SIMD
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx2")) return scanAVX2;
+            if(__builtin_cpu_supports("sse2")) return scanSSE2;
+#endif
+            return scanScalar;
+        }
+
+        PaletteScan::Kernel hostKernel(){
+            static const PaletteScan::Kernel kernel = selectKernel();
+            return kernel;
+        }
+    }
+
+    PaletteScan::PaletteScan(const Palette& palette):
+        m_palette(palette),
+        m_kernel(hostKernel()),
+        m_perceptual(false),
+        m_space(OKLAB)
+    {
+        build(palette);
+    }
+
+    PaletteScan::PaletteScan(const Palette& palette, LabSpace space):
+        m_palette(palette),
+        m_kernel(hostKernel()),
+        m_perceptual(true),
+        m_space(space)
+    {
+        build(palette);
+    }
+
+    void PaletteScan::build(const Palette& palette){
+        if(palette.empty()){
+            throw std::runtime_error("PaletteScan: empty palette");
+        }
+        uint padded = (palette.size() + LANES - 1) / LANES * LANES;
+        m_x.assign(padded, UNREACHABLE);
+        m_y.assign(padded, UNREACHABLE);
+        m_z.assign(padded, UNREACHABLE);
+        if(m_perceptual){
+            toLab(palette.data(), m_x.data(), m_y.data(), m_z.data(), palette.size(), m_space);
+            return;
+        }
+        for(uint i = 0; i < palette.size(); i++){
+            m_x[i] = palette[i].r;
+            m_y[i] = palette[i].g;
+            m_z[i] = palette[i].b;
+        }
+    }
+
+    uint PaletteScan::closestIndex(const RGB& color) const{
+        if(m_perceptual){
+            Lab lab = toLab(color, m_space);
+            return m_kernel(m_x.data(), m_y.data(), m_z.data(), m_x.size(), lab.l, lab.a, lab.b);
+        }
+        return m_kernel(m_x.data(), m_y.data(), m_z.data(), m_x.size(), color.r, color.g, color.b);
+    }
+
+    void PaletteScan::quantizeRow(const RGB* in, RGB* out, uint n) const{
+        const float* x = m_x.data();
+        const float* y = m_y.data();
+        const float* z = m_z.data();
+        uint size = m_x.size();
+        if(m_perceptual){
+            const uint BATCH = 256;
+            float l[BATCH], a[BATCH], b[BATCH];
+            for(uint i = 0; i < n; i += BATCH){
+                uint count = std::min(BATCH, n - i);
+                toLab(in + i, l, a, b, count, m_space);
+                for(uint k = 0; k < count; k++){
+                    out[i + k] = m_palette[m_kernel(x, y, z, size, l[k], a[k], b[k])];
+                }
+            }
+            return;
+        }
+        for(uint i = 0; i < n; i++){
+            out[i] = m_palette[m_kernel(x, y, z, size, in[i].r, in[i].g, in[i].b)];
+        }
+    }
+
+    const char* PaletteScan::instructionSet(){
+#ifdef MIPA_X86_SIMD
+        if(hostKernel() == scanAVX2) return "avx2";
+        if(hostKernel() == scanSSE2) return "sse2";
+#endif
+        return "scalar";
+    }
+}
@@ -0,0 +1,221 @@
+#include "PaletteTable.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace mipa{
+    namespace{
+        const int CELLS = 1 << PaletteTable::CELL_BITS;
+        const int CELL_SIZE = 256 / CELLS;
+
+        inline int cellIndex(int r, int g, int b){
+            return (r * CELLS + g) * CELLS + b;
+        }
+        // Distance from a channel value to the closest value of a cell range
+        template <typename T>
+        inline T nearDelta(T value, T lo, T hi){
+            if(value < lo) return lo - value;
+            if(value > hi) return value - hi;
+            return 0;
+        }
+        // Distance from a channel value to the furthest value of a cell range
+        template <typename T>
+        inline T farDelta(T value, T lo, T hi){
+            return std::max(std::abs(value - lo), std::abs(value - hi));
+        }
+    }
+
+    PaletteTable::PaletteTable(const Palette& palette):
+        m_palette(palette),
+        m_perceptual(false),
+        m_space(OKLAB),
+        m_cellStart(CELLS * CELLS * CELLS + 1, 0)
+    {
+        build();
+    }
+
+    PaletteTable::PaletteTable(const Palette& palette, LabSpace space):
+        m_palette(palette),
+        m_perceptual(true),
+        m_space(space),
+        m_cellStart(CELLS * CELLS * CELLS + 1, 0)
+    {
+        for(const RGB& color: palette){
+            m_lab.push_back(toLab(color, space));
+        }
+        build();
+    }
+
+    void PaletteTable::build(){
+        const Palette& palette = m_palette;
+        if(palette.empty()){
+            throw std::runtime_error("PaletteTable: empty palette");
+        }
+        std::vector<float> minDist(palette.size());
+        for(int cr = 0; cr < CELLS; cr++){
+            int rlo = cr * CELL_SIZE, rhi = rlo + CELL_SIZE - 1;
+            for(int cg = 0; cg < CELLS; cg++){
+                int glo = cg * CELL_SIZE, ghi = glo + CELL_SIZE - 1;
+                for(int cb = 0; cb < CELLS; cb++){
+                    int blo = cb * CELL_SIZE, bhi = blo + CELL_SIZE - 1;
+                    // Any color of the cell is at most at `bound` of some
+                    // palette color, so colors that are always further than
+                    // that can't be the closest one
+                    float bound = 3 * 256 * 256;
+                    if(m_perceptual){
+                        Lab lo, hi;
+                        labBounds(RGB(rlo, glo, blo), RGB(rhi, ghi, bhi), m_space, lo, hi);
+                        bound = std::numeric_limits<float>::max();
+                        for(uint i = 0; i < palette.size(); i++){
+                            const Lab& c = m_lab[i];
+                            float nl = nearDelta(c.l, lo.l, hi.l);
+                            float na = nearDelta(c.a, lo.a, hi.a);
+                            float nb = nearDelta(c.b, lo.b, hi.b);
+                            float fl = farDelta(c.l, lo.l, hi.l);
+                            float fa = farDelta(c.a, lo.a, hi.a);
+                            float fb = farDelta(c.b, lo.b, hi.b);
+                            minDist[i] = nl * nl + na * na + nb * nb;
+                            bound = std::min(bound, fl * fl + fa * fa + fb * fb);
+                        }
+                    }else{
+                        for(uint i = 0; i < palette.size(); i++){
+                            const RGB& c = palette[i];
+                            int nr = nearDelta<int>(c.r, rlo, rhi);
+                            int ng = nearDelta<int>(c.g, glo, ghi);
+                            int nb = nearDelta<int>(c.b, blo, bhi);
+                            int fr = farDelta<int>(c.r, rlo, rhi);
+                            int fg = farDelta<int>(c.g, glo, ghi);
+                            int fb = farDelta<int>(c.b, blo, bhi);
+                            minDist[i] = nr * nr + ng * ng + nb * nb;
+                            bound = std::min<float>(bound, fr * fr + fg * fg + fb * fb);
+                        }
+                    }
+                    for(uint i = 0; i < palette.size(); i++){
+                        if(minDist[i] <= bound){
+                            m_candidates.push_back(i);
+                        }
+                    }
+                    m_cellStart[cellIndex(cr, cg, cb) + 1] = m_candidates.size();
+                }
+            }
+        }
+    }
+
+    uint PaletteTable::closest(const RGB& color, const Lab& lab) const{
+        const int shift = 8 - CELL_BITS;
+        int cell = cellIndex(color.r >> shift, color.g >> shift, color.b >> shift);
+        const uint* it = m_candidates.data() + m_cellStart[cell];
+        const uint* end = m_candidates.data() + m_cellStart[cell + 1];
+        uint best = *it;
+        if(m_perceptual){
+            float bestDist = labSquaredDistance(lab, m_lab[best]);
+            for(++it; it != end; ++it){
+                float dist = labSquaredDistance(lab, m_lab[*it]);
+                if(dist < bestDist){
+                    best = *it;
+                    bestDist = dist;
+                }
+            }
+            return best;
+        }
+        int bestDist = rgbSquaredDistance(color, m_palette[best]);
+        for(++it; it != end; ++it){
+            int dist = rgbSquaredDistance(color, m_palette[*it]);
+            if(dist < bestDist){
+                best = *it;
+                bestDist = dist;
+            }
+        }
+        return best;
+    }
+
+    const RGB& PaletteTable::closest(const RGB& color) const{
+        return m_palette[closest(color, m_perceptual ? toLab(color, m_space) : Lab())];
+    }
+
+    void PaletteTable::quantizeRow(const RGB* in, RGB* out, uint n) const{
+        if(!m_perceptual){
+            for(uint i = 0; i < n; i++){
+                out[i] = m_palette[closest(in[i], Lab())];
+            }
+            return;
+        }
+        const uint BATCH = 256;
+        float l[BATCH], a[BATCH], b[BATCH];
+        for(uint i = 0; i < n; i += BATCH){
+            uint count = std::min(BATCH, n - i);
+            toLab(in + i, l, a, b, count, m_space);
+            for(uint k = 0; k < count; k++){
+                Lab lab;
+                lab.l = l[k];
+                lab.a = a[k];
+                lab.b = b[k];
+                out[i + k] = m_palette[closest(in[i + k], lab)];
+            }
+        }
+    }
+
+    GrayTable::GrayTable(const Palette& palette):
+        m_palette(palette),
+        m_luminance(&Luminance::current()),
+        m_levelFirst(LEVELS),
+        m_levelLast(LEVELS)
+    {
+        if(palette.empty()){
+            throw std::runtime_error("GrayTable: empty palette");
+        }
+        std::vector<std::pair<float, uint>> sorted(palette.size());
+        for(uint i = 0; i < palette.size(); i++){
+            sorted[i] = std::make_pair(m_luminance->value(palette[i]), i);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        for(const auto& entry: sorted){
+            m_keys.push_back(entry.first);
+            m_order.push_back(entry.second);
+        }
+        // The closest value to any point of [lo, hi] lies between the last
+        // value below lo and the first value above hi
+        for(int level = 0; level < LEVELS; level++){
+            float lo = (float)level / LEVELS;
+            float hi = (float)(level + 1) / LEVELS;
+            uint first = std::lower_bound(m_keys.begin(), m_keys.end(), lo) - m_keys.begin();
+            uint last = std::upper_bound(m_keys.begin(), m_keys.end(), hi) - m_keys.begin();
+            first = first > 0 ? first - 1 : 0;
+            // Equal values are sorted by palette index, keep the first one
+            while(first > 0 && m_keys[first - 1] == m_keys[first]) first--;
+            m_levelFirst[level] = first;
+            m_levelLast[level] = std::min<uint>(last, m_keys.size() - 1);
+        }
+    }
+
+    const RGB& GrayTable::closest(const RGB& color) const{
+        return closest(m_luminance->value(color));
+    }
+
+    void GrayTable::quantizeRow(const RGB* in, RGB* out, uint n) const{
+        const uint BATCH = 256;
+        float keys[BATCH];
+        for(uint i = 0; i < n; i += BATCH){
+            uint count = std::min(BATCH, n - i);
+            m_luminance->values(in + i, keys, count);
+            for(uint k = 0; k < count; k++){
+                out[i + k] = closest(keys[k]);
+            }
+        }
+    }
+
+    const RGB& GrayTable::closest(float key) const{
+        int level = std::max(0, std::min(LEVELS - 1, (int)(key * LEVELS)));
+        uint best = m_levelFirst[level];
+        float bestDist = std::abs(key - m_keys[best]);
+        for(uint i = best + 1; i <= m_levelLast[level]; i++){
+            float dist = std::abs(key - m_keys[i]);
+            if(dist < bestDist || (dist == bestDist && m_order[i] < m_order[best])){
+                best = i;
+                bestDist = dist;
+            }
+        }
+        return m_palette[m_order[best]];
+    }
+}
@@ -3,6 +3,31 @@
 #include <cmath>
 
 namespace mipa{
+    void directQuantize(ImageView image, const PaletteScan& scan, ThreadPool* pool){
+        forEachBand(image, pool, [&](uint begin, uint end){
+            for(uint y = begin; y < end; y++){
+                scan.quantizeRow(image.row(y), image.row(y), image.width);
+            }
+        });
+    }
+    void directQuantize(sf::Image& image, const PaletteScan& scan){
+        directQuantize(view(image), scan);
+    }
+    void directQuantize(ImageView image, const PaletteTable& table, ThreadPool* pool){
+        forEachBand(image, pool, [&](uint begin, uint end){
+            for(uint y = begin; y < end; y++){
+                table.quantizeRow(image.row(y), image.row(y), image.width);
+            }
+        });
+    }
+    void directQuantize(ImageView image, const GrayTable& table, ThreadPool* pool){
+        forEachBand(image, pool, [&](uint begin, uint end){
+            for(uint y = begin; y < end; y++){
+                table.quantizeRow(image.row(y), image.row(y), image.width);
+            }
+        });
+    }
+
     int Matrix::getWidth() const{
         return w;
     } 
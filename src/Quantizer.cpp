@@ -0,0 +1,108 @@
+#include "Quantizer.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+#include "PaletteScan.hpp"
+#include "PaletteTable.hpp"
+
+namespace mipa{
+    namespace{
+        // Palettes up to this size are searched by brute force instead of
+        // with a lookup table
+        const uint SMALL_PALETTE = 32;
+
+        template <typename Q>
+        void directKernel(ImageView image, const void* strategy, const DitherSettings& d){
+            directQuantize(image, *static_cast<const Q*>(strategy), d.pool);
+        }
+
+        template <typename Q>
+        void floydSteinbergKernel(ImageView image, const void* strategy, const DitherSettings& d){
+            ditherFloydSteinberg(image, *static_cast<const Q*>(strategy), d.threshold, d.pool);
+        }
+
+        template <typename Q>
+        void orderedKernel(ImageView image, const void* strategy, const DitherSettings& d){
+            ditherOrdered(image, *static_cast<const Q*>(strategy), *d.matrix, d.sparsity, d.threshold, d.pool);
+        }
+
+        template <typename Q, uint N>
+        void orderedFixedKernel(ImageView image, const void* strategy, const DitherSettings& d){
+            ditherOrderedFixed<N, N>(image, *static_cast<const Q*>(strategy), *d.matrix, d.sparsity, d.threshold, d.pool);
+        }
+
+        template <typename Q>
+        Quantizer::Kernel selectKernel(const DitherSettings& d){
+            switch(d.method){
+                case FLOYDSTEINBERG_DITHERING:
+                    return floydSteinbergKernel<Q>;
+                case ORDERED_DITHERING:
+                    if(d.matrix == nullptr){
+                        throw std::runtime_error("Quantizer: ordered dithering without matrix");
+                    }
+                    if(d.matrix->getHeight() == d.matrix->getWidth()){
+                        switch(d.matrix->getHeight()){
+                            case 2: return orderedFixedKernel<Q, 2>;
+                            case 4: return orderedFixedKernel<Q, 4>;
+                            case 8: return orderedFixedKernel<Q, 8>;
+                        }
+                    }
+                    return orderedKernel<Q>;
+                case NO_DITHERING:
+                default:
+                    return directKernel<Q>;
+            }
+        }
+    }
+
+    BitQuantizer::BitQuantizer(int bits){
+        int values_per_channel = std::pow(2, bits);
+        double factor = 255.0 / (values_per_channel-1);
+        for(int x = 0; x < 256; x++){
+            table[x] = factor * std::round((double)x / factor);
+        }
+    }
+
+    template <typename Q>
+    void Quantizer::setStrategy(const std::shared_ptr<const Q>& strategy){
+        m_strategy = strategy;
+        m_kernel = selectKernel<Q>(m_dithering);
+    }
+
+    Quantizer::Quantizer(const DitherSettings& dithering):
+        m_kind(NO_QUANTIZATION),
+        m_dithering(dithering)
+    {
+        setStrategy<IdentityQuantizer>(std::make_shared<IdentityQuantizer>());
+    }
+
+    Quantizer::Quantizer(int bits, const DitherSettings& dithering):
+        m_kind(BIT_QUANTIZATION),
+        m_dithering(dithering)
+    {
+        setStrategy<BitQuantizer>(std::make_shared<BitQuantizer>(bits));
+    }
+
+    Quantizer::Quantizer(QuantizerKind kind, const Palette& palette, const DitherSettings& dithering):
+        m_kind(kind),
+        m_dithering(dithering)
+    {
+        if(kind == CLOSEST_RGB && palette.size() <= SMALL_PALETTE){
+            setStrategy<PaletteScan>(std::make_shared<PaletteScan>(palette));
+        }else if(kind == CLOSEST_RGB){
+            setStrategy<PaletteTable>(std::make_shared<PaletteTable>(palette));
+        }else if(kind == CLOSEST_GRAY){
+            setStrategy<GrayTable>(std::make_shared<GrayTable>(palette));
+        }else if(kind == CLOSEST_OKLAB || kind == CLOSEST_LAB){
+            LabSpace space = kind == CLOSEST_OKLAB ? OKLAB : CIELAB;
+            if(palette.size() <= SMALL_PALETTE){
+                setStrategy<PaletteScan>(std::make_shared<PaletteScan>(palette, space));
+            }else{
+                setStrategy<PaletteTable>(std::make_shared<PaletteTable>(palette, space));
+            }
+        }else{
+            throw std::runtime_error("Quantizer: the strategy doesn't use a palette");
+        }
+    }
+}
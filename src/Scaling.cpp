@@ -0,0 +1,890 @@
+#include "Scaling.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MIPA_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace mipa{
+    PixelizeScratch::PixelizeScratch():
+        m_allocations(0){}
+
+    template <typename T>
+    void PixelizeScratch::reserve(std::vector<T>& buffer, size_t size){
+        if(size > buffer.size()){
+            buffer.resize(size);
+            m_allocations++;
+        }
+    }
+
+    void PixelizeScratch::reserve(uint workers, size_t band, size_t block, bool copies){
+        if(workers > m_workers.size()){
+            m_workers.resize(workers);
+            m_allocations++;
+        }
+        for(uint i = 0; i < workers; i++){
+            reserve(m_workers[i].grays, band);
+            reserve(m_workers[i].keys, block);
+            if(copies){
+                reserve(m_workers[i].band, band);
+            }
+        }
+    }
+
+    void PixelizeScratch::reserveArea(uint workers, size_t band, size_t row){
+        if(workers > m_workers.size()){
+            m_workers.resize(workers);
+            m_allocations++;
+        }
+        for(uint i = 0; i < workers; i++){
+            reserve(m_workers[i].band, band);
+            reserve(m_workers[i].filtered, row * 4);
+            reserve(m_workers[i].sums, row * 4);
+        }
+    }
+
+    RGB* PixelizeScratch::strip(size_t pixels){
+        reserve(m_strip, pixels);
+        return m_strip.data();
+    }
+
+    const IntegralImage& PixelizeScratch::table(ConstImageView image, ThreadPool* pool){
+        size_t capacity = m_table.getCapacity();
+        m_table.build(image, pool);
+        if(m_table.getCapacity() != capacity){
+            m_allocations++;
+        }
+        return m_table;
+    }
+
+    const Coverage* PixelizeScratch::coverage(uint width, uint height, sf::Vector2u out){
+        // The buffers never shrink, so any growth changes the total
+        auto capacity = [this](){
+            size_t total = 0;
+            for(const Coverage& coverage: m_coverage){
+                total += coverage.first.capacity() + coverage.weights.capacity();
+            }
+            return total;
+        };
+        size_t before = capacity();
+        m_coverage[0].build(width, out.x);
+        m_coverage[1].build(height, out.y);
+        if(capacity() != before){
+            m_allocations++;
+        }
+        return m_coverage;
+    }
+
+    const std::vector<std::string>& pixelSelectors(){
+        static const std::vector<std::string> selectors = {"avg", "med", "min", "max", "area", "center", "sampled_avg", "sampled_med"};
+        return selectors;
+    }
+
+    sf::Vector2u pixelizedSize(sf::Vector2u size, uint max_width, uint max_height){
+        float ratio = (float)size.y/size.x;
+        uint width, height;
+        if(size.x > size.y){
+            width = max_width;
+            height = width * ratio;
+        }else{
+            height = max_height;
+            width = height / ratio;
+        }
+        return sf::Vector2u(width, height);
+    }
+
+    namespace{
+        // Range [first, last) of source pixels reduced into the pixel i of
+        // the output, in one dimension. Blocks are ceil(blocksize) pixels
+        // long, starting at floor(i * blocksize), and clipped to the source
+        inline void blockRange(uint i, float blocksize, uint size, uint& first, uint& last){
+            first = i * blocksize;
+            last = std::min<uint>(size, first + std::ceil(blocksize));
+        }
+
+        inline GrayKey grayKey(uint32_t gray, const RGB& color){
+            return GrayKey(gray, (uint32_t)color.r << 24 | color.g << 16 | color.b << 8 | color.a);
+        }
+
+        inline RGB colorOf(const GrayKey& key){
+            return RGB(key.second >> 24, key.second >> 16, key.second >> 8, key.second);
+        }
+
+        // Bins of the histogram used to find the median gray key, by its
+        // highest bits
+        const uint GRAY_BINS = 256;
+
+        inline uint grayBin(uint32_t gray){
+            return gray >> 24;
+        }
+
+        // Blocks smaller than this are reduced without a histogram
+        const uint SMALL_BLOCK = 64;
+
+        // Run a function over contiguous parts of a range of rows or
+        // columns, in parallel if a pool is given. The function receives the
+        // index of the thread, to use its own scratch memory, and the part
+        // [begin, end)
+        template <typename B>
+        void forEachRange(uint count, ThreadPool* pool, const B& part){
+            if(pool == nullptr || pool->size() == 1 || count <= 1){
+                part(0u, 0u, count);
+                return;
+            }
+            uint threads = std::min(pool->size(), count);
+            pool->run([&](uint index){
+                if(index < threads){
+                    part(index, (unsigned long)count * index / threads, (unsigned long)count * (index + 1) / threads);
+                }
+            });
+        }
+
+        // Number of threads forEachRange may use
+        inline uint rangeThreads(ThreadPool* pool){
+            return pool == nullptr ? 1 : pool->size();
+        }
+
+        // Fixed point unit of the coverage weights
+        const int COVERAGE_ONE = 1 << 14;
+        // Bits dropped from the rows reduced by the columns, so they fit in
+        // 16 bits with 7 bits of fraction
+        const int FILTER_SHIFT = 7;
+        // Bits dropped from the sums of the reduced rows
+        const int AREA_SHIFT = 14 + 14 - FILTER_SHIFT;
+
+        // Reduce the pixels [first, last) of a row of the output from a row
+        // of the source
+        void filterRowScalar(const RGB* row, const Coverage& columns, uint first, uint last, int16_t* filtered){
+            for(uint i = first; i < last; i++){
+                const RGB* in = row + columns.first[i];
+                const int16_t* weights = &columns.weights[(size_t)i * columns.taps];
+                int32_t r = 0, g = 0, b = 0, a = 0;
+                for(uint k = 0; k < columns.taps; k++){
+                    r += in[k].r * weights[k];
+                    g += in[k].g * weights[k];
+                    b += in[k].b * weights[k];
+                    a += in[k].a * weights[k];
+                }
+                int16_t* out = filtered + (size_t)(i - first) * 4;
+                out[0] = (r + (1 << (FILTER_SHIFT - 1))) >> FILTER_SHIFT;
+                out[1] = (g + (1 << (FILTER_SHIFT - 1))) >> FILTER_SHIFT;
+                out[2] = (b + (1 << (FILTER_SHIFT - 1))) >> FILTER_SHIFT;
+                out[3] = (a + (1 << (FILTER_SHIFT - 1))) >> FILTER_SHIFT;
+            }
+        }
+
+        // Add a reduced row times its weight to the sums of an output row
+        void accumulateRowScalar(const int16_t* filtered, int16_t weight, int32_t* sums, size_t values){
+            for(size_t i = 0; i < values; i++){
+                sums[i] += filtered[i] * weight;
+            }
+        }
+
+#ifdef MIPA_X86_SIMD
+        // Sum of the 4 channels of the taps of an output pixel times their
+        // weights, two taps at a time
+        __attribute__((target("sse2")))
+        inline __m128i filterPixelSSE2(const RGB* in, const int16_t* weights, uint taps){
+            const __m128i zero = _mm_setzero_si128();
+            __m128i sum = zero;
+            uint k = 0;
+            for(; k + 1 < taps; k += 2){
+                // r0 g0 b0 a0 r1 g1 b1 a1 into r0 r1 g0 g1 b0 b1 a0 a1
+                __m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(in + k)), zero);
+                pixels = _mm_unpacklo_epi16(pixels, _mm_unpackhi_epi64(pixels, pixels));
+                int32_t pair;
+                std::memcpy(&pair, weights + k, sizeof(pair));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, _mm_set1_epi32(pair)));
+            }
+            if(k < taps){
+                // Reading two pixels could go past the end of the source
+                int32_t pixel;
+                std::memcpy(&pixel, in + k, sizeof(pixel));
+                __m128i pixels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, _mm_set1_epi32((uint16_t)weights[k])));
+            }
+            return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (FILTER_SHIFT - 1))), FILTER_SHIFT);
+        }
+
+        __attribute__((target("sse2")))
+        void filterRowSSE2(const RGB* row, const Coverage& columns, uint first, uint last, int16_t* filtered){
+            uint taps = columns.taps;
+            const int16_t* weights = columns.weights.data();
+            uint i = first;
+            for(; i + 1 < last; i += 2){
+                __m128i a = filterPixelSSE2(row + columns.first[i], weights + (size_t)i * taps, taps);
+                __m128i b = filterPixelSSE2(row + columns.first[i + 1], weights + (size_t)(i + 1) * taps, taps);
+                _mm_storeu_si128((__m128i*)(filtered + (size_t)(i - first) * 4), _mm_packs_epi32(a, b));
+            }
+            if(i < last){
+                __m128i a = filterPixelSSE2(row + columns.first[i], weights + (size_t)i * taps, taps);
+                _mm_storel_epi64((__m128i*)(filtered + (size_t)(i - first) * 4), _mm_packs_epi32(a, a));
+            }
+        }
+
+        __attribute__((target("sse2")))
+        void accumulateRowSSE2(const int16_t* filtered, int16_t weight, int32_t* sums, size_t values){
+            __m128i w = _mm_set1_epi16(weight);
+            size_t i = 0;
+            for(; i + 8 <= values; i += 8){
+                __m128i f = _mm_loadu_si128((const __m128i*)(filtered + i));
+                __m128i low = _mm_mullo_epi16(f, w);
+                __m128i high = _mm_mulhi_epi16(f, w);
+                __m128i* out = (__m128i*)(sums + i);
+                _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_unpacklo_epi16(low, high)));
+                _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(low, high)));
+            }
+            accumulateRowScalar(filtered + i, weight, sums + i, values - i);
+        }
+#endif
+
+        // Kernels of the area selector, chosen once for the host
+        struct AreaKernels{
+            void (*filterRow)(const RGB* row, const Coverage& columns, uint first, uint last, int16_t* filtered);
+            void (*accumulateRow)(const int16_t* filtered, int16_t weight, int32_t* sums, size_t values);
+        };
+
+        AreaKernels selectAreaKernels(){
+#ifdef MIPA_X86_SIMD
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("sse2")) return {filterRowSSE2, accumulateRowSSE2};
+#endif
+            return {filterRowScalar, accumulateRowScalar};
+        }
+
+        const AreaKernels& areaKernels(){
+            static const AreaKernels kernels = selectAreaKernels();
+            return kernels;
+        }
+
+        // Reduce the rows of the source covered by the row j of the output
+        // into its pixels [first, last). The band holds the rows.taps rows
+        // from rows.first[j]. filtered and sums must have room for the
+        // pixels
+        void areaBand(ConstImageView band, const Coverage& columns, const Coverage& rows, uint j, RGB* outRow, uint first, uint last, int16_t* filtered, int32_t* sums){
+            const AreaKernels& kernels = areaKernels();
+            size_t values = (size_t)(last - first) * 4;
+            std::fill(sums, sums + values, 0);
+            const int16_t* weights = &rows.weights[(size_t)j * rows.taps];
+            for(uint k = 0; k < rows.taps; k++){
+                if(weights[k] == 0) continue;
+                kernels.filterRow(band.row(k), columns, first, last, filtered);
+                kernels.accumulateRow(filtered, weights[k], sums, values);
+            }
+            const int32_t half = 1 << (AREA_SHIFT - 1);
+            auto channel = [half](int32_t sum){
+                return (sf::Uint8)std::max(0, std::min(255, (sum + half) >> AREA_SHIFT));
+            };
+            for(uint i = first; i < last; i++){
+                const int32_t* sum = sums + (size_t)(i - first) * 4;
+                outRow[i] = RGB(channel(sum[0]), channel(sum[1]), channel(sum[2]), channel(sum[3]));
+            }
+        }
+
+        void channelRangeScalar(const RGB* pixels, size_t n, RGB& min, RGB& max){
+            for(size_t i = 0; i < n; i++){
+                const RGB& pixel_color = pixels[i];
+                min.r = std::min(min.r, pixel_color.r);
+                min.g = std::min(min.g, pixel_color.g);
+                min.b = std::min(min.b, pixel_color.b);
+                max.r = std::max(max.r, pixel_color.r);
+                max.g = std::max(max.g, pixel_color.g);
+                max.b = std::max(max.b, pixel_color.b);
+            }
+        }
+
+        void remapRowScalar(const RGB* in, RGB* out, size_t n, const ChannelMap& map){
+            for(size_t i = 0; i < n; i++){
+                out[i] = map(in[i]);
+            }
+        }
+
+#ifdef MIPA_X86_SIMD
+        __attribute__((target("sse2")))
+        void channelRangeSSE2(const RGB* pixels, size_t n, RGB& min, RGB& max){
+            __m128i lo = _mm_set1_epi8((char)0xff);
+            __m128i hi = _mm_setzero_si128();
+            size_t i = 0;
+            for(; i + 4 <= n; i += 4){
+                __m128i p = _mm_loadu_si128((const __m128i*)(pixels + i));
+                lo = _mm_min_epu8(lo, p);
+                hi = _mm_max_epu8(hi, p);
+            }
+            // Join the 4 pixels of each register into the first one
+            lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 8));
+            lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 4));
+            hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 8));
+            hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 4));
+            uint32_t low = _mm_cvtsi128_si32(lo);
+            uint32_t high = _mm_cvtsi128_si32(hi);
+            min.r = std::min<sf::Uint8>(min.r, low);
+            min.g = std::min<sf::Uint8>(min.g, low >> 8);
+            min.b = std::min<sf::Uint8>(min.b, low >> 16);
+            max.r = std::max<sf::Uint8>(max.r, high);
+            max.g = std::max<sf::Uint8>(max.g, high >> 8);
+            max.b = std::max<sf::Uint8>(max.b, high >> 16);
+            channelRangeScalar(pixels + i, n - i, min, max);
+        }
+
+        // With the scale split in its high and low 16 bits, the product
+        // (v * scale) >> 16 is v * high plus the high half of v * low. It
+        // fits in 16 bits as the scale is at most 255 << 16
+        __attribute__((target("sse2")))
+        inline __m128i remapHalfSSE2(__m128i v, __m128i offset, __m128i high, __m128i low){
+            v = _mm_subs_epu16(v, offset);
+            v = _mm_add_epi16(_mm_mullo_epi16(v, high), _mm_mulhi_epu16(v, low));
+            // Values above 255 would be taken as negative when packed
+            return _mm_sub_epi16(v, _mm_subs_epu16(v, _mm_set1_epi16(255)));
+        }
+
+        __attribute__((target("sse2")))
+        void remapRowSSE2(const RGB* in, RGB* out, size_t n, const ChannelMap& map){
+            if(!map.linear){
+                remapRowScalar(in, out, n, map);
+                return;
+            }
+            // The alpha is multiplied by 1
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i offset = _mm_setr_epi16(map.offset[0], map.offset[1], map.offset[2], 0, map.offset[0], map.offset[1], map.offset[2], 0);
+            __m128i high = _mm_setr_epi16(map.scale[0] >> 16, map.scale[1] >> 16, map.scale[2] >> 16, 1, map.scale[0] >> 16, map.scale[1] >> 16, map.scale[2] >> 16, 1);
+            __m128i low = _mm_setr_epi16(map.scale[0] & 0xffff, map.scale[1] & 0xffff, map.scale[2] & 0xffff, 0, map.scale[0] & 0xffff, map.scale[1] & 0xffff, map.scale[2] & 0xffff, 0);
+            size_t i = 0;
+            for(; i + 4 <= n; i += 4){
+                __m128i p = _mm_loadu_si128((const __m128i*)(in + i));
+                __m128i a = remapHalfSSE2(_mm_unpacklo_epi8(p, zero), offset, high, low);
+                __m128i b = remapHalfSSE2(_mm_unpackhi_epi8(p, zero), offset, high, low);
+                _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(a, b));
+            }
+            remapRowScalar(in + i, out + i, n - i, map);
+        }
+#endif
+
+        // Kernels of the normalization, chosen once for the host
+        struct NormalizeKernels{
+            void (*channelRange)(const RGB* pixels, size_t n, RGB& min, RGB& max);
+            void (*remapRow)(const RGB* in, RGB* out, size_t n, const ChannelMap& map);
+        };
+
+        NormalizeKernels selectNormalizeKernels(){
+#ifdef MIPA_X86_SIMD
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("sse2")) return {channelRangeSSE2, remapRowSSE2};
+#endif
+            return {channelRangeScalar, remapRowScalar};
+        }
+
+        const NormalizeKernels& normalizeKernels(){
+            static const NormalizeKernels kernels = selectNormalizeKernels();
+            return kernels;
+        }
+    }
+
+    void Coverage::build(uint size, uint outSize){
+        // Output pixel i covers [i * size / outSize, (i + 1) * size / outSize)
+        // of the source, which touches at most ceil(size / outSize) + 1
+        // pixels. Everything is measured in 1 / outSize of a source pixel so
+        // it's exact
+        taps = std::min(size, (size + outSize - 1) / outSize + 1);
+        first.resize(outSize);
+        weights.assign((size_t)outSize * taps, 0);
+        for(uint i = 0; i < outSize; i++){
+            uint64_t lo = (uint64_t)i * size;
+            uint64_t hi = (uint64_t)(i + 1) * size;
+            uint start = lo / outSize;
+            uint end = (hi + outSize - 1) / outSize;
+            first[i] = std::min(start, size - taps);
+            int16_t* w = &weights[(size_t)i * taps];
+            // Each weight is the difference of the rounded coverage up to
+            // both sides of its pixel, so none is negative and they add up
+            // to exactly the unit
+            auto covered = [&](uint64_t x){
+                uint64_t edge = std::min(std::max(x * outSize, lo), hi);
+                return (int)(((edge - lo) * COVERAGE_ONE + size / 2) / size);
+            };
+            for(uint x = start; x < end; x++){
+                w[x - first[i]] = covered(x + 1) - covered(x);
+            }
+        }
+    }
+
+    void pixelize(const IntegralImage& table, ImageView out, ThreadPool* pool){
+        float blockwidth = (float)table.getWidth() / out.width;
+        float blockheight = (float)table.getHeight() / out.height;
+        forEachRange(out.height, pool, [&](uint, uint begin, uint end){
+            for(uint j = begin; j < end; j++){
+                uint y0, y1;
+                blockRange(j, blockheight, table.getHeight(), y0, y1);
+                if(y0 >= y1) continue;
+                RGB* outRow = out.row(j);
+                for(uint i = 0; i < out.width; i++){
+                    uint x0, x1;
+                    blockRange(i, blockwidth, table.getWidth(), x0, x1);
+                    if(x0 < x1){
+                        outRow[i] = table.average(x0, y0, x1, y1);
+                    }
+                }
+            }
+        });
+    }
+
+    namespace{
+        typedef enum {
+            SELECT_AVG,
+            SELECT_MED,
+            SELECT_MIN,
+            SELECT_MAX,
+            SELECT_AREA,
+            SELECT_CENTER,
+            SELECT_SAMPLED_AVG,
+            SELECT_SAMPLED_MED
+        } Selector;
+
+        Selector parseSelector(const std::string& selector){
+            if(selector == "avg") return SELECT_AVG;
+            if(selector == "med") return SELECT_MED;
+            if(selector == "min") return SELECT_MIN;
+            if(selector == "max") return SELECT_MAX;
+            if(selector == "area") return SELECT_AREA;
+            if(selector == "center") return SELECT_CENTER;
+            if(selector == "sampled_avg") return SELECT_SAMPLED_AVG;
+            if(selector == "sampled_med") return SELECT_SAMPLED_MED;
+            throw std::runtime_error("Unkown pixel selector: "+selector);
+        }
+
+        inline bool isSampling(Selector selector){
+            return selector == SELECT_CENTER || selector == SELECT_SAMPLED_AVG || selector == SELECT_SAMPLED_MED;
+        }
+
+        // Scramble the bits of a number, so the samples of neighbour blocks
+        // don't follow a pattern
+        inline uint32_t mixBits(uint32_t x){
+            x ^= x >> 16;
+            x *= 0x7feb352d;
+            x ^= x >> 15;
+            x *= 0x846ca68b;
+            x ^= x >> 16;
+            return x;
+        }
+
+        // Reduce a band of rows into the pixels [first, last) of the row j
+        // of the output, from a few pixels of each block. The block is split
+        // in a grid of at least samples cells, and a pixel is taken from a
+        // random place of each one, that depends only on the block and the
+        // cell. Thin blocks get more cells along their long side, and blocks
+        // with no more pixels than samples get one cell per pixel, so they
+        // are taken whole. keys must have room for samples + ceil(sqrt(
+        // samples)) cells
+        void sampleBand(ConstImageView band, float blockwidth, uint j, RGB* outRow, uint first, uint last, Selector selector, uint samples, const ChannelMap* map, GrayKey* keys){
+            const Luminance& luminance = Luminance::current();
+            uint rows = band.height;
+            uint gridWidth = std::ceil(std::sqrt((float)samples));
+            for(uint i = first; i < last; i++){
+                uint x0, x1;
+                blockRange(i, blockwidth, band.width, x0, x1);
+                if(x0 >= x1) continue;
+                uint columns = x1 - x0;
+                if(selector == SELECT_CENTER){
+                    RGB color = band.row(rows / 2)[x0 + columns / 2];
+                    outRow[i] = map != nullptr ? (*map)(color) : color;
+                    continue;
+                }
+                uint cellsX = std::min(columns, gridWidth);
+                uint gridHeight = std::min(rows, (samples + cellsX - 1) / cellsX);
+                cellsX = std::min(columns, std::max(cellsX, (samples + gridHeight - 1) / gridHeight));
+                uint n = 0;
+                uint32_t r = 0, g = 0, b = 0, a = 0;
+                for(uint cy = 0; cy < gridHeight; cy++){
+                    uint ys = rows * cy / gridHeight;
+                    uint ye = rows * (cy + 1) / gridHeight;
+                    for(uint cx = 0; cx < cellsX; cx++){
+                        uint xs = x0 + columns * cx / cellsX;
+                        uint xe = x0 + columns * (cx + 1) / cellsX;
+                        uint32_t randomX = mixBits(i * 0x9e3779b9u ^ mixBits(j * 0x85ebca6bu ^ (n + 1)));
+                        uint32_t randomY = mixBits(randomX);
+                        RGB color = band.row(ys + randomY % (ye - ys))[xs + randomX % (xe - xs)];
+                        if(map != nullptr){
+                            color = (*map)(color);
+                        }
+                        if(selector == SELECT_SAMPLED_AVG){
+                            r += color.r;
+                            g += color.g;
+                            b += color.b;
+                            a += color.a;
+                        }else{
+                            keys[n] = grayKey(luminance.key(color), color);
+                        }
+                        n++;
+                    }
+                }
+                if(selector == SELECT_SAMPLED_AVG){
+                    outRow[i] = RGB(r / n, g / n, b / n, a / n);
+                }else{
+                    std::nth_element(keys, keys + n / 2, keys + n);
+                    outRow[i] = colorOf(keys[n / 2]);
+                }
+            }
+        }
+
+        // Reduce a band of rows into the pixels [first, last) of a row of the
+        // output, summing each block
+        void averageBand(ConstImageView band, float blockwidth, RGB* outRow, uint first, uint last){
+            for(uint i = first; i < last; i++){
+                uint x0, x1;
+                blockRange(i, blockwidth, band.width, x0, x1);
+                if(x0 >= x1) continue;
+                uint64_t r = 0, g = 0, b = 0, a = 0;
+                for(uint y = 0; y < band.height; y++){
+                    const RGB* row = band.row(y);
+                    for(uint x = x0; x < x1; x++){
+                        r += row[x].r;
+                        g += row[x].g;
+                        b += row[x].b;
+                        a += row[x].a;
+                    }
+                }
+                uint64_t n = (uint64_t)(x1 - x0) * band.height;
+                outRow[i] = RGB(r / n, g / n, b / n, a / n);
+            }
+        }
+
+        // Reduce a band of rows into the pixels [first, last) of a row of the
+        // output, choosing a color of each block by its gray value. grays
+        // must have room for the columns of the band under those pixels, and
+        // keys for a block
+        void grayBand(ConstImageView band, float blockwidth, RGB* outRow, uint first, uint last, Selector selector, uint32_t* grays, GrayKey* keys){
+            const Luminance& luminance = Luminance::current();
+            uint rows = band.height;
+            uint xs, xe, unused;
+            blockRange(first, blockwidth, band.width, xs, unused);
+            blockRange(last - 1, blockwidth, band.width, unused, xe);
+            uint stride = xe - xs;
+            for(uint y = 0; y < rows; y++){
+                luminance.keys(band.row(y) + xs, grays + (size_t)y * stride, stride);
+            }
+            auto key = [&](uint x, uint y) -> GrayKey {
+                return grayKey(grays[(size_t)y * stride + x - xs], band.row(y)[x]);
+            };
+            uint histogram[GRAY_BINS];
+            for(uint i = first; i < last; i++){
+                uint x0, x1;
+                blockRange(i, blockwidth, band.width, x0, x1);
+                uint n = (x1 - x0) * rows;
+                if(n == 0) continue;
+                GrayKey chosen;
+                if(selector != SELECT_MED){
+                    chosen = key(x0, 0);
+                    for(uint y = 0; y < rows; y++){
+                        for(uint x = x0; x < x1; x++){
+                            GrayKey k = key(x, y);
+                            if(selector == SELECT_MIN ? k < chosen : chosen < k){
+                                chosen = k;
+                            }
+                        }
+                    }
+                }else if(n < SMALL_BLOCK){
+                    uint m = 0;
+                    for(uint y = 0; y < rows; y++){
+                        for(uint x = x0; x < x1; x++){
+                            keys[m++] = key(x, y);
+                        }
+                    }
+                    std::nth_element(keys, keys + n / 2, keys + n);
+                    chosen = keys[n / 2];
+                }else{
+                    std::fill(histogram, histogram + GRAY_BINS, 0);
+                    for(uint y = 0; y < rows; y++){
+                        const uint32_t* rowGrays = grays + (size_t)y * stride;
+                        for(uint x = x0; x < x1; x++){
+                            histogram[grayBin(rowGrays[x - xs])]++;
+                        }
+                    }
+                    // Find the bin of the median and sort out only the
+                    // colors inside it
+                    uint rank = n / 2;
+                    uint bin = 0;
+                    while(histogram[bin] <= rank){
+                        rank -= histogram[bin];
+                        bin++;
+                    }
+                    uint m = 0;
+                    for(uint y = 0; y < rows; y++){
+                        for(uint x = x0; x < x1; x++){
+                            GrayKey k = key(x, y);
+                            if(grayBin(k.first) == bin){
+                                keys[m++] = k;
+                            }
+                        }
+                    }
+                    std::nth_element(keys, keys + rank, keys + m);
+                    chosen = keys[rank];
+                }
+                outRow[i] = colorOf(chosen);
+            }
+        }
+
+        // Reduce an image band by band. The summed-area table is only used
+        // when told to, as it's as big as the source
+        void reduceBands(ConstImageView image, ImageView out, Selector selector, uint samples, const ChannelMap* map, bool useTable, PixelizeScratch& scratch, ThreadPool* pool){
+            if(selector == SELECT_AVG && useTable){
+                pixelize(scratch.table(image, pool), out, pool);
+                return;
+            }
+            if(selector == SELECT_AREA){
+                const Coverage* coverage = scratch.coverage(image.width, image.height, sf::Vector2u(out.width, out.height));
+                const Coverage& columns = coverage[0];
+                const Coverage& rows = coverage[1];
+                scratch.reserveArea(rangeThreads(pool), map != nullptr ? (size_t)image.width * rows.taps : 0, out.width);
+                forEachRange(out.height, pool, [&](uint worker, uint begin, uint end){
+                    for(uint j = begin; j < end; j++){
+                        ConstImageView band = image.sub(0, rows.first[j], image.width, rows.taps);
+                        if(map != nullptr){
+                            ImageView copy(scratch.band(worker), image.width, rows.taps, image.width);
+                            for(uint y = 0; y < copy.height; y++){
+                                normalizeKernels().remapRow(band.row(y), copy.row(y), copy.width, *map);
+                            }
+                            band = copy;
+                        }
+                        areaBand(band, columns, rows, j, out.row(j), 0, out.width, scratch.filtered(worker), scratch.sums(worker));
+                    }
+                });
+                return;
+            }
+            float blockwidth = (float)image.width / out.width;
+            float blockheight = (float)image.height / out.height;
+            uint maxBlockWidth = std::ceil(blockwidth);
+            uint maxBlockHeight = std::ceil(blockheight);
+            if(isSampling(selector)){
+                // Only the samples are read, and mapped, so the cost doesn't
+                // depend on the size of the source
+                samples = std::max(1u, samples);
+                scratch.reserve(rangeThreads(pool), 0, samples + (uint)std::ceil(std::sqrt((float)samples)));
+                forEachRange(out.height, pool, [&](uint worker, uint begin, uint end){
+                    for(uint j = begin; j < end; j++){
+                        uint y0, y1;
+                        blockRange(j, blockheight, image.height, y0, y1);
+                        if(y0 < y1){
+                            sampleBand(image.sub(0, y0, image.width, y1 - y0), blockwidth, j, out.row(j), 0, out.width, selector, samples, map, scratch.keys(worker));
+                        }
+                    }
+                });
+                return;
+            }
+            scratch.reserve(rangeThreads(pool), (size_t)image.width * maxBlockHeight, (size_t)maxBlockWidth * maxBlockHeight, map != nullptr);
+            forEachRange(out.height, pool, [&](uint worker, uint begin, uint end){
+                for(uint j = begin; j < end; j++){
+                    uint y0, y1;
+                    blockRange(j, blockheight, image.height, y0, y1);
+                    if(y0 >= y1) continue;
+                    ConstImageView band = image.sub(0, y0, image.width, y1 - y0);
+                    if(map != nullptr){
+                        // Map a copy of the band, while it's in cache
+                        ImageView copy(scratch.band(worker), image.width, y1 - y0, image.width);
+                        for(uint y = 0; y < copy.height; y++){
+                            normalizeKernels().remapRow(band.row(y), copy.row(y), copy.width, *map);
+                        }
+                        band = copy;
+                    }
+                    if(selector == SELECT_AVG){
+                        averageBand(band, blockwidth, out.row(j), 0, out.width);
+                    }else{
+                        grayBand(band, blockwidth, out.row(j), 0, out.width, selector, scratch.grays(worker), scratch.keys(worker));
+                    }
+                }
+            });
+        }
+    }
+
+    void pixelize(ConstImageView image, ImageView out, const std::string& selector, PixelizeScratch* scratch, ThreadPool* pool, uint samples){
+        PixelizeScratch local;
+        reduceBands(image, out, parseSelector(selector), samples, nullptr, true, scratch ? *scratch : local, pool);
+    }
+
+    void pixelizeBands(ConstImageView image, ImageView out, const std::string& selector, const ChannelMap* map, PixelizeScratch* scratch, ThreadPool* pool, uint samples){
+        PixelizeScratch local;
+        reduceBands(image, out, parseSelector(selector), samples, map, false, scratch ? *scratch : local, pool);
+    }
+
+    void pixelize(StripReader& reader, ImageView out, const std::string& selector, const ChannelMap* map, PixelizeScratch* scratch, ThreadPool* pool, uint samples){
+        Selector sel = parseSelector(selector);
+        PixelizeScratch local;
+        if(scratch == nullptr){
+            scratch = &local;
+        }
+        uint width = reader.getWidth();
+        uint height = reader.getHeight();
+        float blockwidth = (float)width / out.width;
+        float blockheight = (float)height / out.height;
+        uint maxBlockWidth = std::ceil(blockwidth);
+        uint maxBlockHeight = std::ceil(blockheight);
+        // The columns of each output row are split between the threads, so
+        // each one only needs room for its part of the band
+        uint threads = std::min(rangeThreads(pool), out.width);
+        const Coverage* coverage = nullptr;
+        if(sel == SELECT_AREA){
+            coverage = scratch->coverage(width, height, sf::Vector2u(out.width, out.height));
+            maxBlockHeight = coverage[1].taps;
+            scratch->reserveArea(threads, 0, (out.width + threads - 1) / threads);
+        }else if(isSampling(sel)){
+            samples = std::max(1u, samples);
+            scratch->reserve(threads, 0, samples + (uint)std::ceil(std::sqrt((float)samples)));
+        }else{
+            size_t part = std::min<size_t>(width, (size_t)((out.width + threads - 1) / threads) * maxBlockWidth);
+            scratch->reserve(threads, part * maxBlockHeight, (size_t)maxBlockWidth * maxBlockHeight);
+        }
+        RGB* strip = scratch->strip((size_t)width * maxBlockHeight);
+        // Rows [first, last) of the image held in the strip
+        uint first = 0, last = 0;
+        auto readRows = [&](RGB* rows, uint count){
+            reader.read(rows, count);
+            if(map != nullptr){
+                normalizeKernels().remapRow(rows, rows, (size_t)width * count, *map);
+            }
+        };
+        for(uint j = 0; j < out.height; j++){
+            uint y0, y1;
+            if(coverage != nullptr){
+                y0 = coverage[1].first[j];
+                y1 = y0 + coverage[1].taps;
+            }else{
+                blockRange(j, blockheight, height, y0, y1);
+            }
+            if(y0 >= y1) continue;
+            if(y0 < last){
+                // Keep the rows shared with the previous band
+                std::copy(strip + (size_t)(y0 - first) * width, strip + (size_t)(last - first) * width, strip);
+            }else{
+                while(last < y0){
+                    uint skip = std::min(y0 - last, maxBlockHeight);
+                    reader.read(strip, skip);
+                    last += skip;
+                }
+            }
+            first = y0;
+            if(y1 > last){
+                readRows(strip + (size_t)(last - first) * width, y1 - last);
+                last = y1;
+            }
+            ConstImageView band(strip, width, y1 - y0, width);
+            RGB* outRow = out.row(j);
+            forEachRange(out.width, pool, [&](uint worker, uint begin, uint end){
+                if(sel == SELECT_AVG){
+                    averageBand(band, blockwidth, outRow, begin, end);
+                }else if(sel == SELECT_AREA){
+                    areaBand(band, coverage[0], coverage[1], j, outRow, begin, end, scratch->filtered(worker), scratch->sums(worker));
+                }else if(isSampling(sel)){
+                    // The map was applied when reading
+                    sampleBand(band, blockwidth, j, outRow, begin, end, sel, samples, nullptr, scratch->keys(worker));
+                }else{
+                    grayBand(band, blockwidth, outRow, begin, end, sel, scratch->grays(worker), scratch->keys(worker));
+                }
+            });
+        }
+    }
+
+    sf::Image pixelize(const sf::Image& image, uint max_width, uint max_height, const std::string& selector, PixelizeScratch* scratch, ThreadPool* pool, uint samples){
+        sf::Vector2u size = pixelizedSize(image.getSize(), max_width, max_height);
+        sf::Image newimg;
+        newimg.create(size.x, size.y);
+        pixelize(view(image), view(newimg), selector, scratch, pool, samples);
+        return newimg;
+    }
+
+    void channelRange(const RGB* pixels, size_t n, RGB& min, RGB& max){
+        normalizeKernels().channelRange(pixels, n, min, max);
+    }
+
+    ChannelMap normalization(const RGB& min, const RGB& max){
+        ChannelMap map;
+        map.linear = true;
+        sf::Uint8* tables[3] = {map.r, map.g, map.b};
+        const sf::Uint8 lo[3] = {min.r, min.g, min.b};
+        const sf::Uint8 hi[3] = {max.r, max.g, max.b};
+        for(int c = 0; c < 3; c++){
+            // floor(255 * x / d) is (x * ceil(255 * 2^16 / d)) >> 16 for any
+            // x in [0, d]. A channel with a single value is kept
+            int d = hi[c] - lo[c];
+            map.offset[c] = d > 0 ? lo[c] : 0;
+            map.scale[c] = d > 0 ? (255u * 65536 + d - 1) / d : 65536;
+            for(int v = 0; v < 256; v++){
+                uint32_t x = std::max(v - map.offset[c], 0);
+                tables[c][v] = std::min<uint32_t>(255, (x * map.scale[c]) >> 16);
+            }
+        }
+        return map;
+    }
+
+    ChannelMap normalization(ConstImageView image, ThreadPool* pool){
+        // Each thread finds the range of its rows, and then they are joined
+        uint threads = rangeThreads(pool);
+        std::vector<RGB> mins(threads, RGB(0xff, 0xff, 0xff)), maxs(threads, RGB(0, 0, 0));
+        forEachRange(image.height, pool, [&](uint worker, uint begin, uint end){
+            for(uint r = begin; r < end; r++){
+                channelRange(image.row(r), image.width, mins[worker], maxs[worker]);
+            }
+        });
+        RGB min(0xff, 0xff, 0xff), max(0, 0, 0);
+        for(uint i = 0; i < threads; i++){
+            channelRange(&mins[i], 1, min, max);
+            channelRange(&maxs[i], 1, min, max);
+        }
+        return normalization(min, max);
+    }
+
+    ChannelMap normalization(StripReader& reader, PixelizeScratch* scratch){
+        PixelizeScratch local;
+        if(scratch == nullptr){
+            scratch = &local;
+        }
+        // Read the image in strips of a few rows
+        const uint STRIP_ROWS = 16;
+        uint width = reader.getWidth();
+        RGB* strip = scratch->strip((size_t)width * STRIP_ROWS);
+        RGB min(0xff, 0xff, 0xff), max(0, 0, 0);
+        while(reader.getRow() < reader.getHeight()){
+            uint rows = std::min(STRIP_ROWS, reader.getHeight() - reader.getRow());
+            reader.read(strip, rows);
+            channelRange(strip, (size_t)width * rows, min, max);
+        }
+        return normalization(min, max);
+    }
+
+    ChannelMap normalization(StripReader& reader, ImageView image){
+        if(image.width != reader.getWidth() || image.height != reader.getHeight() - reader.getRow()){
+            throw std::runtime_error("normalization: the image doesn't match the reader");
+        }
+        // Strips can only be decoded in one go if the rows are contiguous
+        const uint STRIP_ROWS = image.stride == image.width ? 16 : 1;
+        RGB min(0xff, 0xff, 0xff), max(0, 0, 0);
+        for(uint y = 0; y < image.height; y += STRIP_ROWS){
+            uint rows = std::min(STRIP_ROWS, image.height - y);
+            reader.read(image.row(y), rows);
+            for(uint r = y; r < y + rows; r++){
+                channelRange(image.row(r), image.width, min, max);
+            }
+        }
+        return normalization(min, max);
+    }
+
+    void remap(ImageView image, const ChannelMap& map, ThreadPool* pool){
+        const NormalizeKernels& kernels = normalizeKernels();
+        forEachRange(image.height, pool, [&](uint, uint begin, uint end){
+            for(uint r = begin; r < end; r++){
+                kernels.remapRow(image.row(r), image.row(r), image.width, map);
+            }
+        });
+    }
+
+    void normalize(ImageView image, ThreadPool* pool){
+        remap(image, normalization(image, pool), pool);
+    }
+
+    void normalize(sf::Image& image, ThreadPool* pool){
+        normalize(view(image), pool);
+    }
+}
@@ -0,0 +1,303 @@
+#include "StripReader.hpp"
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <png.h>
+#include <jpeglib.h>
+
+// The decoding libraries report errors with longjmp, so no object with a
+// destructor may be created between each setjmp and the library calls that
+// it protects.
+
+namespace mipa{
+    StripReader::StripReader():
+        m_width(0),
+        m_height(0),
+        m_fullWidth(0),
+        m_fullHeight(0),
+        m_row(0){}
+
+    StripReader::~StripReader(){}
+
+    bool StripReader::scaleTo(uint, uint){
+        return false;
+    }
+
+    namespace{
+        class PngStripReader: public StripReader{
+        public:
+            PngStripReader(const std::string& path):
+                m_path(path),
+                m_file(nullptr),
+                m_png(nullptr),
+                m_info(nullptr),
+                m_interlaced(false){
+                m_error[0] = '\0';
+                start();
+            }
+
+            ~PngStripReader(){
+                finish();
+            }
+
+            inline bool isInterlaced() const{
+                return m_interlaced;
+            }
+
+            void read(RGB* rows, uint count){
+                if(setjmp(png_jmpbuf(m_png))){
+                    fail();
+                }
+                for(uint i = 0; i < count; i++){
+                    png_read_row(m_png, (png_bytep)(rows + (size_t)i * m_width), nullptr);
+                }
+                m_row += count;
+            }
+
+            void rewind(){
+                finish();
+                start();
+            }
+
+        private:
+            void start(){
+                m_file = std::fopen(m_path.c_str(), "rb");
+                if(m_file == nullptr){
+                    throw std::runtime_error("StripReader: Couldn't open " + m_path);
+                }
+                m_png = png_create_read_struct(PNG_LIBPNG_VER_STRING, this, error, warning);
+                if(m_png != nullptr){
+                    m_info = png_create_info_struct(m_png);
+                }
+                if(m_info == nullptr){
+                    finish();
+                    throw std::runtime_error("StripReader: Not enough memory for " + m_path);
+                }
+                if(setjmp(png_jmpbuf(m_png))){
+                    fail();
+                }
+                png_init_io(m_png, m_file);
+                png_read_info(m_png, m_info);
+                png_uint_32 width, height;
+                int depth, color, interlace;
+                png_get_IHDR(m_png, m_info, &width, &height, &depth, &color, &interlace, nullptr, nullptr);
+                // Always decode to 8 bit RGBA, the layout of RGB
+                png_set_expand(m_png);
+                png_set_strip_16(m_png);
+                if(color == PNG_COLOR_TYPE_GRAY || color == PNG_COLOR_TYPE_GRAY_ALPHA){
+                    png_set_gray_to_rgb(m_png);
+                }
+                png_set_filler(m_png, 0xff, PNG_FILLER_AFTER);
+                png_read_update_info(m_png, m_info);
+                m_width = m_fullWidth = width;
+                m_height = m_fullHeight = height;
+                m_row = 0;
+                m_interlaced = interlace != PNG_INTERLACE_NONE;
+                if(png_get_rowbytes(m_png, m_info) != (size_t)width * sizeof(RGB)){
+                    finish();
+                    throw std::runtime_error("StripReader: Unsupported PNG format in " + m_path);
+                }
+            }
+
+            void finish(){
+                if(m_png != nullptr){
+                    png_destroy_read_struct(&m_png, m_info ? &m_info : nullptr, nullptr);
+                }
+                if(m_file != nullptr){
+                    std::fclose(m_file);
+                }
+                m_png = nullptr;
+                m_info = nullptr;
+                m_file = nullptr;
+            }
+
+            // Called after a longjmp from the library
+            void fail(){
+                finish();
+                throw std::runtime_error("StripReader: " + m_path + ": " + m_error);
+            }
+
+            static void error(png_structp png, png_const_charp message){
+                PngStripReader* reader = (PngStripReader*)png_get_error_ptr(png);
+                std::strncpy(reader->m_error, message, sizeof(reader->m_error) - 1);
+                reader->m_error[sizeof(reader->m_error) - 1] = '\0';
+                longjmp(png_jmpbuf(png), 1);
+            }
+
+            static void warning(png_structp, png_const_charp){}
+
+            std::string m_path;
+            std::FILE* m_file;
+            png_structp m_png;
+            png_infop m_info;
+            bool m_interlaced;
+            char m_error[256];
+        };
+
+        class JpegStripReader: public StripReader{
+        public:
+            JpegStripReader(const std::string& path):
+                m_path(path),
+                m_file(nullptr),
+                m_created(false),
+                m_denominator(1){
+                start();
+            }
+
+            ~JpegStripReader(){
+                finish();
+            }
+
+            void read(RGB* rows, uint count){
+                if(setjmp(m_error.jump)){
+                    fail();
+                }
+                JSAMPROW line = m_line.data();
+                for(uint i = 0; i < count; i++){
+                    jpeg_read_scanlines(&m_jpeg, &line, 1);
+                    RGB* row = rows + (size_t)i * m_width;
+                    for(uint x = 0; x < m_width; x++){
+                        row[x] = RGB(line[3 * x], line[3 * x + 1], line[3 * x + 2]);
+                    }
+                }
+                m_row += count;
+            }
+
+            bool scaleTo(uint minWidth, uint minHeight){
+                // The scales every version of libjpeg supports
+                uint denominator = 8;
+                while(denominator > 1 && (scaled(m_fullWidth, denominator) < minWidth || scaled(m_fullHeight, denominator) < minHeight)){
+                    denominator /= 2;
+                }
+                if(denominator != m_denominator){
+                    m_denominator = denominator;
+                    rewind();
+                }
+                return m_denominator > 1;
+            }
+
+            void rewind(){
+                finish();
+                start();
+            }
+
+        private:
+            static inline uint scaled(uint size, uint denominator){
+                return (size + denominator - 1) / denominator;
+            }
+
+            struct ErrorManager{
+                jpeg_error_mgr manager;
+                std::jmp_buf jump;
+                char message[JMSG_LENGTH_MAX];
+            };
+
+            void start(){
+                m_file = std::fopen(m_path.c_str(), "rb");
+                if(m_file == nullptr){
+                    throw std::runtime_error("StripReader: Couldn't open " + m_path);
+                }
+                m_jpeg.err = jpeg_std_error(&m_error.manager);
+                m_error.manager.error_exit = error;
+                m_error.manager.output_message = warning;
+                if(setjmp(m_error.jump)){
+                    fail();
+                }
+                jpeg_create_decompress(&m_jpeg);
+                m_created = true;
+                jpeg_stdio_src(&m_jpeg, m_file);
+                jpeg_read_header(&m_jpeg, TRUE);
+                m_fullWidth = m_jpeg.image_width;
+                m_fullHeight = m_jpeg.image_height;
+                m_jpeg.out_color_space = JCS_RGB;
+                m_jpeg.scale_num = 1;
+                m_jpeg.scale_denom = m_denominator;
+                jpeg_start_decompress(&m_jpeg);
+                m_width = m_jpeg.output_width;
+                m_height = m_jpeg.output_height;
+                m_row = 0;
+                m_line.resize((size_t)m_width * 3);
+            }
+
+            void finish(){
+                if(m_created){
+                    jpeg_destroy_decompress(&m_jpeg);
+                }
+                if(m_file != nullptr){
+                    std::fclose(m_file);
+                }
+                m_created = false;
+                m_file = nullptr;
+            }
+
+            // Called after a longjmp from the library
+            void fail(){
+                finish();
+                throw std::runtime_error("StripReader: " + m_path + ": " + m_error.message);
+            }
+
+            static void error(j_common_ptr jpeg){
+                ErrorManager* manager = (ErrorManager*)jpeg->err;
+                (*jpeg->err->format_message)(jpeg, manager->message);
+                std::longjmp(manager->jump, 1);
+            }
+
+            static void warning(j_common_ptr){}
+
+            std::string m_path;
+            std::FILE* m_file;
+            jpeg_decompress_struct m_jpeg;
+            ErrorManager m_error;
+            bool m_created;
+            uint m_denominator;
+            std::vector<JSAMPLE> m_line;
+        };
+    }
+
+    namespace{
+        // Read the first bytes of a file, returning how many were read
+        size_t readMagic(const std::string& path, unsigned char* magic, size_t size){
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if(file == nullptr){
+                throw std::runtime_error("StripReader: Couldn't open " + path);
+            }
+            size_t length = std::fread(magic, 1, size, file);
+            std::fclose(file);
+            return length;
+        }
+
+        inline bool isJpeg(const unsigned char* magic, size_t length){
+            return length >= 3 && magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff;
+        }
+    }
+
+    std::unique_ptr<StripReader> StripReader::open(const std::string& path){
+        unsigned char magic[8] = {0};
+        size_t length = readMagic(path, magic, sizeof(magic));
+        if(length == sizeof(magic) && png_sig_cmp(magic, 0, sizeof(magic)) == 0){
+            std::unique_ptr<PngStripReader> reader(new PngStripReader(path));
+            // Interlaced rows only get their final value after the last pass
+            if(reader->isInterlaced()){
+                return nullptr;
+            }
+            return std::unique_ptr<StripReader>(reader.release());
+        }
+        if(isJpeg(magic, length)){
+            return std::unique_ptr<StripReader>(new JpegStripReader(path));
+        }
+        return nullptr;
+    }
+
+    bool StripReader::isScalable(const std::string& path){
+        unsigned char magic[3] = {0};
+        try{
+            return isJpeg(magic, readMagic(path, magic, sizeof(magic)));
+        }catch(const std::exception&){
+            return false;
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+
+namespace mipa{
+    ThreadPool::ThreadPool(uint threads):
+        m_task(nullptr),
+        m_generation(0),
+        m_pending(0),
+        m_stop(false)
+    {
+        if(threads == 0){
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for(uint i = 1; i < threads; i++){
+            m_workers.emplace_back(&ThreadPool::work, this, i);
+        }
+    }
+
+    ThreadPool::~ThreadPool(){
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_start.notify_all();
+        for(auto& worker: m_workers){
+            worker.join();
+        }
+    }
+
+    void ThreadPool::work(uint index){
+        unsigned long seen = 0;
+        while(true){
+            const std::function<void(uint)>* task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_start.wait(lock, [&]{ return m_stop || m_generation != seen; });
+                if(m_stop) return;
+                seen = m_generation;
+                task = m_task;
+            }
+            std::exception_ptr error;
+            try{
+                (*task)(index);
+            }catch(...){
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(error && !m_error) m_error = error;
+            if(--m_pending == 0) m_done.notify_one();
+        }
+    }
+
+    void ThreadPool::run(const std::function<void(uint)>& task){
+        if(m_workers.empty()){
+            task(0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_task = &task;
+            m_pending = m_workers.size();
+            m_error = nullptr;
+            m_generation++;
+        }
+        m_start.notify_all();
+        std::exception_ptr error;
+        try{
+            task(0);
+        }catch(...){
+            error = std::current_exception();
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [&]{ return m_pending == 0; });
+        if(!error) error = m_error;
+        if(error) std::rethrow_exception(error);
+    }
+
+    void ThreadPool::parallelFor(uint count, const std::function<void(uint, uint)>& task){
+        uint threads = std::min(size(), std::max(1u, count));
+        if(threads == 1){
+            task(0, count);
+            return;
+        }
+        run([&](uint index){
+            if(index >= threads) return;
+            uint begin = (unsigned long)count * index / threads;
+            uint end = (unsigned long)count * (index + 1) / threads;
+            task(begin, end);
+        });
+    }
+}
@@ -1,8 +1,9 @@
+#include <algorithm>
 #include <cmath>
 #include <fstream>
-#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <regex>
 #include <string>
 #include <sstream>
@@ -11,9 +12,14 @@
 #include <SFML/Graphics.hpp>
 
 #include "json.hpp"
+#include "Benchmark.hpp"
 #include "Color.hpp"
 #include "Palette.hpp"
 #include "Quantization.hpp"
+#include "Quantizer.hpp"
+#include "Scaling.hpp"
+#include "StripReader.hpp"
+#include "ThreadPool.hpp"
 
 #ifdef _WIN32
 const std::string sep("\\");
@@ -55,102 +61,6 @@ void log(LogType level, std::string msg_pre, std::string end="\n"){
  * IMAGE PROCESSING FUNCTIONS
  */
 
-sf::Image pixelize(const sf::Image& image, uint max_width, uint max_height, const std::string& selector="avg"){
-    log(INFO, "Pixelizing...", "");
-    sf::Vector2u origImgSize = image.getSize();
-    float ratio = (float)origImgSize.y/origImgSize.x;
-    uint width, height;
-    if(origImgSize.x > origImgSize.y){
-        width = max_width;
-        height = width * ratio;
-    }else{
-        height = max_height;
-        width = height / ratio;
-    }
-    
-    RGB (*selectorfun)(const Palette&);        
-    if(selector == "avg"){
-        selectorfun = [](const Palette& p)->RGB{
-            uint sr=0, sg=0, sb=0, sa=0;
-            for(auto& c: p){
-                sr += c.r;
-                sg += c.g;
-                sb += c.b;
-                sa += c.a;
-            }
-            uint n = p.size();
-            return RGB(sr/n, sg/n, sb/n, sa/n);
-        };
-    }else if(selector == "med"){
-        selectorfun = [](const Palette& p)->RGB{
-            return graySorted(p)[p.size()/2];
-        };
-    }else if(selector == "min"){
-        selectorfun = [](const Palette& p)->RGB{
-            return graySorted(p)[0];
-        };
-    }else if(selector == "max"){
-        selectorfun = [](const Palette& p)->RGB{
-            return graySorted(p)[p.size()-1];
-        };
-    }else{
-        throw std::runtime_error("Unkown pixel selector: "+selector);
-    }
-    sf::Image newimg;
-    float blockwidth = (float)origImgSize.x / width;
-    float blockheight = (float)origImgSize.y / height;
-    newimg.create(width, height);
-    for(uint j = 0; j <= height; j++){
-        for(uint i = 0; i <= width; i++){
-            std::vector<RGB> block;
-            for(uint bj = 0; bj < blockheight; bj++){
-                uint y = j * blockheight + bj;
-                if(y >= origImgSize.y) break;
-                for(uint bi = 0; bi < blockwidth; bi++){
-                    uint x = i * blockwidth + bi;
-                    if(x >= origImgSize.x) break;
-                    block.push_back(image.getPixel(x,y));
-                }
-            }
-            if(!block.empty()){
-                newimg.setPixel(i,j,selectorfun(block));
-            }
-        }
-    }
-    return newimg;
-}
-
-void normalize(sf::Image& image){
-    log(INFO, "Normalizing...", "");
-    sf::Vector2u imgSize = image.getSize();
-    sf::Uint8 minR = 0xff, maxR = 0;
-    sf::Uint8 minG = 0xff, maxG = 0;
-    sf::Uint8 minB = 0xff, maxB = 0;
-    for(int r = 0; r < imgSize.y; r++){
-        for(int c = 0; c < imgSize.x; c++){
-            sf::Color pixel_color = image.getPixel(c, r);
-            minR = std::min(minR, pixel_color.r);
-            minG = std::min(minG, pixel_color.g);
-            minB = std::min(minB, pixel_color.b);
-            maxR = std::max(maxR, pixel_color.r);
-            maxG = std::max(maxG, pixel_color.g);
-            maxB = std::max(maxB, pixel_color.b);
-        }
-    }
-    int dr = maxR - minR;
-    int dg = maxG - minG;
-    int db = maxB - minB;
-    for(int r = 0; r < imgSize.y; r++){
-        for(int c = 0; c < imgSize.x; c++){
-            sf::Color pixel_color = image.getPixel(c, r);
-            pixel_color.r = 255 * ((float)pixel_color.r - minR)/dr;
-            pixel_color.g = 255 * ((float)pixel_color.g - minG)/dg;
-            pixel_color.b = 255 * ((float)pixel_color.b - minB)/db;
-            image.setPixel(c, r, pixel_color);
-        }
-    }
-}
-
 void palette_to_file(const Palette& palette, const std::string& path, int rows=1){
     sf::Image image;
     image.create(50*palette.size()/rows, 150*rows);
@@ -168,8 +78,10 @@ void print_help(){
     std::cout << "Program to make images look like pixel art." << std::endl;
     std::cout << "" << std::endl;
     std::cout << "OPTIONS" << std::endl;
+    std::cout << "  -b, --bench             Measure the speed of each stage and print it as JSON." << std::endl;
     std::cout << "  -c, --config-file PATH  Set the configuration file." << std::endl;
     std::cout << "  -h, --help              Print this help message and exit." << std::endl;
+    std::cout << "  -j, --jobs N            Set the number of threads (0 to use all the cores)." << std::endl;
     std::cout << "  -o, --output-dir DIR    Set the output directory for the generated images." << std::endl;
     std::cout << "  -p, --palette PATH      Create an image to display the palette." << std::endl;
     std::cout << "  -x, --config CONFIG     Set the CLI configuration as a JSON formatted string." << std::endl;
@@ -186,18 +98,22 @@ int main(int argc, char** argv){
     }
     // PARSE ARGUMENTS INTO PARAMETERS
     const std::map<std::string, std::string> args_shorts = {
+        {"-b", "--bench"},
         {"-c", "--config-file"},
         {"-x", "--config"},
         {"-o", "--output-dir"},
         {"-h", "--help"},
+        {"-j", "--jobs"},
         {"-p", "--palette"},
     };
     std::map<std::string, bool> flags = {
+        {"--bench", false},
     };
     std::map<std::string, std::string> opts = {
         {"--config", "{}"},
         {"--config-file", ""},
         {"--output-dir", "."},
+        {"--jobs", ""},
         {"--palette", ""},
     };
     std::vector<std::string> positional;
@@ -237,7 +153,7 @@ int main(int argc, char** argv){
         log(ERROR, last_real_opt + " expected an option value");
         return -1;
     }
-    if(positional.size() == 0 && opts["--palette"] == ""){
+    if(positional.size() == 0 && opts["--palette"] == "" && !flags["--bench"]){
         log(ERROR, "No files provided");
         return -1;
     }
@@ -250,10 +166,15 @@ int main(int argc, char** argv){
     // DEFAULT CONFIGURATION
     json config = {
         {"normalize", "no"}, // no, pre, post
-        {"select_pixel", "avg"}, // avg, med, min, max
-        {"width", 64}, // <number>
-        {"height", 64}, // <number>
-        {"quantization", "none"}, // none, bit<number>, closest_rgb, closest_gray
+        {"select_pixel", "avg"}, // avg, med, min, max, area, center, sampled_avg, sampled_med
+        {"samples", 16}, // <number>, pixels read from each block by sampled_*
+        {"width", 64}, // <number>, <number> array
+        {"height", 64}, // <number>, <number> array
+        {"threads", 0}, // <number>, 0 for all the cores
+        {"pipeline", "stages"}, // stages, fused
+        {"loader", "image"}, // image, stream
+        {"decode_scale", "auto"}, // auto, full
+        {"quantization", "none"}, // none, bit<number>, closest_rgb, closest_gray, closest_oklab, closest_lab
         {"dithering", 
             {
                 {"method", "none"}, // none, floydsteinberg, ordered
@@ -270,6 +191,13 @@ int main(int argc, char** argv){
                 {"inter", 0}, // <number>
                 {"disparity", 0.85} // <number>
             } // object or <color> array
+        },
+        {"bench",
+            {
+                {"megapixels", {1, 12, 48}}, // <number> array
+                {"inputs", {"noise", "gradient", "photo"}}, // noise, gradient, photo
+                {"repeat", 3} // <number>
+            }
         }
     };
     // FILE CONFIGURATION
@@ -291,6 +219,76 @@ int main(int argc, char** argv){
     if(cli_config.size() > 0){
         config.merge_patch(cli_config);
     }
+    if(opts["--jobs"].size() > 0){
+        // A value that isn't a whole number is kept as text, so it's
+        // reported as a bad threads option below
+        config["threads"] = opts["--jobs"];
+        try{
+            size_t end;
+            int jobs = std::stoi(opts["--jobs"], &end);
+            if(end == opts["--jobs"].size()){
+                config["threads"] = jobs;
+            }
+        }catch(const std::exception&){}
+    }
+
+    // THREADS
+    if(!config["threads"].is_number_integer() || config["threads"].get<int>() < 0){
+        log(ERROR, "Bad threads option: " + config["threads"].dump());
+        return -1;
+    }
+    ThreadPool pool(config["threads"].get<uint>());
+
+    // OUTPUT SIZES
+    // width and height can be numbers or lists of the same length. A number
+    // is used with every value of the other list
+    std::vector<sf::Vector2u> max_sizes;
+    {
+        auto is_size = [](const json& value){
+            return value.is_number_integer() && value.get<int>() > 0;
+        };
+        auto as_list = [&](const json& value, std::vector<uint>& list){
+            if(is_size(value)){
+                list.push_back(value.get<uint>());
+                return true;
+            }
+            if(!value.is_array() || value.empty()) return false;
+            for(const json& item: value){
+                if(!is_size(item)) return false;
+                list.push_back(item.get<uint>());
+            }
+            return true;
+        };
+        std::vector<uint> widths, heights;
+        if(!as_list(config["width"], widths) || !as_list(config["height"], heights)
+            || (widths.size() > 1 && heights.size() > 1 && widths.size() != heights.size())){
+            log(ERROR, "Bad width and height options: " + config["width"].dump() + ", " + config["height"].dump());
+            return -1;
+        }
+        for(size_t i = 0; i < std::max(widths.size(), heights.size()); i++){
+            max_sizes.push_back(sf::Vector2u(
+                widths[std::min(i, widths.size() - 1)],
+                heights[std::min(i, heights.size() - 1)]
+            ));
+        }
+    }
+
+    // BENCHMARK
+    if(flags["--bench"]){
+        json bench_config = config["bench"];
+        bench_config["width"] = max_sizes[0].x;
+        bench_config["height"] = max_sizes[0].y;
+        try{
+            json report = benchmark(bench_config, pool, [](const std::string& msg){
+                log(INFO, msg);
+            });
+            std::cout << report.dump(2) << std::endl;
+        }catch(const std::exception& ex){
+            log(ERROR, ex.what());
+            return -1;
+        }
+        return 0;
+    }
     
     // log(IMPORTANT, "Configuration");
     // log(PLAIN, config.dump(2));
@@ -419,33 +417,25 @@ int main(int argc, char** argv){
 
     // BUILD COLOR SELECTION STRATEGY
     double sparsity = 0;
-    std::function<RGB(const RGB&)> quantizer = [&](const RGB& rgb) -> RGB { return rgb; };
+    QuantizerKind quantizer_kind = NO_QUANTIZATION;
+    int bit_num = 8;
     if(config["quantization"].is_string() && config["quantization"].get<std::string>().substr(0, 3) == "bit"){
-        int bit_num = std::stoi(config["quantization"].get<std::string>().substr(3));
+        bit_num = std::stoi(config["quantization"].get<std::string>().substr(3));
         int values_per_channel = std::pow(2, bit_num);
         double factor = 255.0 / (values_per_channel-1);
-        const auto qchannel = [factor](int x) -> int { 
-            double r =  factor * std::round((double)x / factor); 
-            return r;
-        };
-        quantizer = [qchannel](const RGB &rgb) -> RGB {
-            return RGB(
-                qchannel(rgb.r),
-                qchannel(rgb.g),
-                qchannel(rgb.b),
-                rgb.a
-            );
-        };
+        quantizer_kind = BIT_QUANTIZATION;
         sparsity = factor;
     }else if(config["quantization"] == "closest_rgb"){
-        quantizer = [palette](const RGB &rgb) -> RGB {
-            return closestByColor(palette, rgb)[0];
-        };
+        quantizer_kind = CLOSEST_RGB;
         sparsity = 255.0 / palette.size();
     }else if(config["quantization"] == "closest_gray"){
-        quantizer = [palette](const RGB &rgb) -> RGB {
-            return closestByBrightness(palette, rgb)[0];
-        };
+        quantizer_kind = CLOSEST_GRAY;
+        sparsity = 255.0 / palette.size();
+    }else if(config["quantization"] == "closest_oklab"){
+        quantizer_kind = CLOSEST_OKLAB;
+        sparsity = 255.0 / palette.size();
+    }else if(config["quantization"] == "closest_lab"){
+        quantizer_kind = CLOSEST_LAB;
         sparsity = 255.0 / palette.size();
     }else if(config["quantization"] != "none"){
         log(ERROR, "Bad quantization option: " + config["quantization"].dump());
@@ -470,70 +460,258 @@ int main(int argc, char** argv){
         return -1;
     }
 
+    //// Dithering
+    DitherSettings dithering;
+    dithering.matrix = &matrix_it->second;
+    dithering.sparsity = sparsity;
+    dithering.threshold = config["dithering"]["threshold"].get<float>() * 255 / 100000;
+    if(config["dithering"]["method"] == "floydsteinberg"){
+        dithering.method = FLOYDSTEINBERG_DITHERING;
+    }else if(config["dithering"]["method"] == "ordered"){
+        dithering.method = ORDERED_DITHERING;
+    }else if(config["dithering"]["method"] == "none"){
+        dithering.method = NO_DITHERING;
+    }else{
+        log(ERROR, "Bad dithering method option: " + config["dithering"]["method"].dump());
+        return -1;
+    }
+
+    dithering.pool = &pool;
+
+    //// Resolve the quantization function once for all the files
+    std::unique_ptr<Quantizer> quantizer;
+    switch(quantizer_kind){
+        case BIT_QUANTIZATION:
+            quantizer.reset(new Quantizer(bit_num, dithering));
+            break;
+        case CLOSEST_RGB:
+        case CLOSEST_GRAY:
+        case CLOSEST_OKLAB:
+        case CLOSEST_LAB:
+            quantizer.reset(new Quantizer(quantizer_kind, palette, dithering));
+            break;
+        case NO_QUANTIZATION:
+            quantizer.reset(new Quantizer(dithering));
+            break;
+    }
+
+    //// Pipeline
+    bool fused;
+    if(config["pipeline"] == "fused"){
+        fused = true;
+    }else if(config["pipeline"] == "stages"){
+        fused = false;
+    }else{
+        log(ERROR, "Bad pipeline option: " + config["pipeline"].dump());
+        return -1;
+    }
+    bool stream;
+    if(config["loader"] == "stream"){
+        stream = true;
+    }else if(config["loader"] == "image"){
+        stream = false;
+    }else{
+        log(ERROR, "Bad loader option: " + config["loader"].dump());
+        return -1;
+    }
+    bool scaled_decode;
+    if(config["decode_scale"] == "auto"){
+        scaled_decode = true;
+    }else if(config["decode_scale"] == "full"){
+        scaled_decode = false;
+    }else{
+        log(ERROR, "Bad decode_scale option: " + config["decode_scale"].dump());
+        return -1;
+    }
+
+    if(!config["samples"].is_number_integer() || config["samples"].get<int>() < 1){
+        log(ERROR, "Bad samples option: " + config["samples"].dump());
+        return -1;
+    }
+    uint samples = config["samples"].get<uint>();
+
     // START FILE PROCESSING
     std::regex parent_dir_re (".*/");
+    PixelizeScratch scratch;
+    std::string selector = config["select_pixel"].get<std::string>();
+    bool pre_normalize = config["normalize"] == "pre";
     for(const std::string& file: positional){
         // LOAD FILE
         std::string name = std::regex_replace(file, parent_dir_re, "");
-        sf::Image img, out;
+        sf::Image img;
         log(IMPORTANT, name);
-        log(INFO, "Loading image...", "");
-        if(img.loadFromFile(file)){
-            log(INFO, "Loaded", "");
-        }else{
-            log(ERROR, "Couldn't load "+file);
-            continue;
-        }
-        
-        // PROCESS IMAGE
-        
-        //// Normalization
-        if(config["normalize"] == "pre"){
-            normalize(img);
-        }else if(config["normalize"] != "post" && config["normalize"] != "no"){
+        if(config["normalize"] != "pre" && config["normalize"] != "post" && config["normalize"] != "no"){
             log(ERROR, "Bad normalize option: " + config["normalize"].dump());
             return -1;
         }
+        // JPEG files much bigger than the output are decoded smaller, down
+        // to twice the size of the biggest output
+        std::unique_ptr<StripReader> reader;
+        sf::Vector2u full_size;
+        bool loaded = false;
+        ChannelMap normalization_map;
+        // Whether normalization_map already holds the range of img
+        bool measured = false;
+        if(stream || (scaled_decode && StripReader::isScalable(file))){
+            try{
+                reader = StripReader::open(file);
+                if(reader){
+                    full_size = sf::Vector2u(reader->getFullWidth(), reader->getFullHeight());
+                    sf::Vector2u biggest(0, 0);
+                    for(const sf::Vector2u& max_size: max_sizes){
+                        sf::Vector2u size = pixelizedSize(full_size, max_size.x, max_size.y);
+                        biggest.x = std::max(biggest.x, size.x);
+                        biggest.y = std::max(biggest.y, size.y);
+                    }
+                    bool scaled = scaled_decode && reader->scaleTo(2 * biggest.x, 2 * biggest.y);
+                    if(scaled){
+                        log(INFO, "Decoding at " + std::to_string(reader->getWidth()) + "x" + std::to_string(reader->getHeight()));
+                    }
+                    if(!stream){
+                        if(scaled){
+                            log(INFO, "Loading image...", "");
+                            img.create(reader->getWidth(), reader->getHeight());
+                            if(pre_normalize){
+                                // Measured while each strip is in cache
+                                normalization_map = normalization(*reader, view(img));
+                                measured = true;
+                            }else{
+                                reader->read(view(img).pixels, reader->getHeight());
+                            }
+                            log(INFO, "Loaded", "");
+                            loaded = true;
+                        }
+                        reader.reset();
+                    }
+                }else if(stream){
+                    log(WARNING, "Can't be read by rows, loading it whole");
+                }
+            }catch(const std::exception& ex){
+                if(stream){
+                    log(ERROR, ex.what());
+                    continue;
+                }
+                // SFML may still load what the decoder rejected, like
+                // CMYK JPEG files
+                log(WARNING, std::string(ex.what()) + ", loading it whole");
+                reader.reset();
+                loaded = false;
+                measured = false;
+            }
+        }
+        if(!reader && !loaded){
+            log(INFO, "Loading image...", "");
+            if(img.loadFromFile(file)){
+                log(INFO, "Loaded", "");
+            }else{
+                log(ERROR, "Couldn't load "+file);
+                continue;
+            }
+            full_size = img.getSize();
+        }
 
-        //// Scaling
-        out = pixelize(
-            img, 
-            config["width"].get<uint>(), 
-            config["height"].get<uint>(), 
-            config["select_pixel"].get<std::string>()
-        );
-        
+        // PROCESS IMAGE
 
-        //// Normalization
-        if(config["normalize"] == "post"){
-            normalize(out);
+        //// Work shared by all the sizes
+        const IntegralImage* table = nullptr;
+        try{
+            if(reader){
+                // Normalizing needs the range of the whole image first, so
+                // it's read once more
+                if(pre_normalize){
+                    log(INFO, "Normalizing...", "");
+                    normalization_map = normalization(*reader, &scratch);
+                    reader->rewind();
+                }
+            }else if(fused){
+                // The normalization is applied to each band of rows right
+                // before reducing it, so the source is only read
+                if(pre_normalize && !measured){
+                    normalization_map = normalization(view(img), &pool);
+                }
+            }else{
+                if(pre_normalize){
+                    log(INFO, "Normalizing...", "");
+                    // Images loaded by SFML are only measured here, so the
+                    // source is read once to find the range and once more
+                    // to remap it before scaling. The fused pipeline skips
+                    // the remap pass
+                    if(!measured){
+                        normalization_map = normalization(view(img), &pool);
+                    }
+                    remap(view(img), normalization_map, &pool);
+                }
+                // The blocks of every size are averaged from the same table
+                if(selector == "avg"){
+                    table = &scratch.table(view(img), &pool);
+                }
+            }
+        }catch(const std::exception& ex){
+            log(ERROR, ex.what());
+            continue;
         }
-        // Quantization and dithering
-        float threshold = config["dithering"]["threshold"].get<float>() * 255 / 100000;
-        if(config["dithering"]["method"] == "floydsteinberg"){
 
-            ditherFloydSteinberg(out, quantizer, threshold);
-
-        }else if(config["dithering"]["method"] == "ordered"){
+        // The output size comes from the size of the file, even if it was
+        // decoded smaller. Only one of the limits applies to each image, so
+        // different limits may give the same size, which is made only once
+        std::vector<sf::Vector2u> sizes;
+        for(const sf::Vector2u& max_size: max_sizes){
+            sf::Vector2u size = pixelizedSize(full_size, max_size.x, max_size.y);
+            auto same = [&](const sf::Vector2u& other){
+                return other.x == size.x && other.y == size.y;
+            };
+            if(std::find_if(sizes.begin(), sizes.end(), same) != sizes.end()){
+                log(WARNING, "Size " + std::to_string(size.x) + "x" + std::to_string(size.y) + " repeated, made only once");
+            }else{
+                sizes.push_back(size);
+            }
+        }
 
-            ditherOrdered(out, quantizer, matrix_it->second, sparsity, threshold);
-            
-        }else if(config["dithering"]["method"] == "none"){
+        for(const sf::Vector2u& size: sizes){
+            //// Scaling
+            sf::Image out;
+            out.create(size.x, size.y);
+            log(INFO, "Pixelizing...", "");
+            try{
+                if(reader){
+                    // The rows are reduced as they are decoded, so the file
+                    // is decoded again for each size
+                    if(reader->getRow() > 0){
+                        reader->rewind();
+                    }
+                    pixelize(*reader, view(out), selector, pre_normalize ? &normalization_map : nullptr, &scratch, &pool, samples);
+                }else if(fused){
+                    pixelizeBands(view(img), view(out), selector, pre_normalize ? &normalization_map : nullptr, &scratch, &pool, samples);
+                }else if(table != nullptr){
+                    pixelize(*table, view(out), &pool);
+                }else{
+                    pixelize(view(img), view(out), selector, &scratch, &pool, samples);
+                }
+            }catch(const std::exception& ex){
+                log(ERROR, ex.what());
+                break;
+            }
 
-            directQuantize(out, quantizer);
-        
-        }else{
-        
-            log(ERROR, "Bad dithering method option: " + config["dithering"]["method"].dump());
-            return -1;
-        
+            //// Normalization
+            if(config["normalize"] == "post"){
+                log(INFO, "Normalizing...", "");
+                normalize(out);
+            }
+            // Quantization and dithering
+            quantizer->apply(out);
+
+            // SAVE IT
+            // With several sizes, each file is named after its size
+            std::string out_name = name;
+            if(max_sizes.size() > 1){
+                size_t dot = name.rfind('.');
+                if(dot == std::string::npos) dot = name.size();
+                out_name.insert(dot, "_" + std::to_string(size.x) + "x" + std::to_string(size.y));
+            }
+            log(INFO, "Saving...", "");
+            out.saveToFile(opts["--output-dir"] + out_name);
+            log(SUCCESS, "Done " + out_name);
         }
-
-        
-        // SAVE IT
-        log(INFO, "Saving...", "");
-        out.saveToFile(opts["--output-dir"] + name);
-        log(SUCCESS, "Done");
     }
     return 0;
 }
\ No newline at end of file